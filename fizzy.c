@@ -1,32 +1,39 @@
 #define _POSIX_C_SOURCE 200809
 
-#include "config.h"
-
 #include <stdio.h>
 
 #include <readline/readline.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdalign.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-#if WITH_OMP
-# include <omp.h>
+#if defined(__x86_64__) || defined(__i386__)
+# define WITH_X86 1
+# include <immintrin.h>
+#else
+# define WITH_X86 0
 #endif
 
-#define IF1(cond, if_true) IF1_(cond, if_true)
-#define IF1_(cond, if_true) IF1_##cond##_(if_true)
-#define IF1_0_(x)
-#define IF1_1_(x) x
-
 #define REPEAT1(i) xmacro(i)
 #define REPEAT2(i) REPEAT1(i) REPEAT1(1 + i)
 #define REPEAT4(i) REPEAT2(i) REPEAT2(2 + i)
@@ -51,17 +58,178 @@
 #endif
 
 enum {
-	QUERY_SIZE = 32,
+	QUERY_SIZE = 256,
+	/* Query is matched using masks of this many bits... */
+	MASK_BITS = 64,
+	/* ...and this many words. */
+	MASK_WORDS = QUERY_SIZE / MASK_BITS,
+	/* Collect arriving records for this long before redrawing. */
+	REDRAW_MSEC = 50,
+	/* Score in slices at least this long so key presses are noticed. */
+	SLICE_MSEC = REDRAW_MSEC / 8,
+	/* Disconnect clients not taking a response for this long. */
+	CLIENT_TIMEOUT_MSEC = 1000,
+	CHUNK_SIZE = 1 << 20,
+	/* Unit of counting and moving scored records. */
+	SCORE_BLOCK_SIZE = 1024,
+	/* Pool threads take records of about this many bytes at once... */
+	POOL_CHUNK_BYTES = 1 << 16,
+	/* ...counting this much for each record too. */
+	POOL_RECORD_BYTES = 32,
+	/* Fewer records are sorted by comparing them. */
+	RADIX_SORT_SIZE = 1 << 10,
+	/* Unit of counting and moving sort keys. */
+	RADIX_SEGMENT_SIZE = 1 << 16,
+	/* Default number of results per query in batch mode. */
+	BATCH_TOP = 10,
+	/* Records are scored for every query of a group while cached. */
+	BATCH_CHUNK_BYTES = 1 << 15,
+	/* Limits on size of a group of queries. */
+	BATCH_MAX_TERMS = 1 << 11,
+	BATCH_MAX_HITS = 1 << 22,
+	READ_BATCH = 1024,
+	INDEX_MAGIC = 0x7a7a6966, /* "fizz" */
+	INDEX_VERSION = 3,
+	/* Size of records that do not fit into struct record. */
+	WIDE_SIZE = UINT32_MAX,
+	/* Bytes of wide records scored at once. */
+	DP_WINDOW = 1 << 30,
 };
 
+/* Records of wide_size or more bytes have their uint64_t size stored just
+ * before the header and WIDE_SIZE as size. */
 struct record {
 	uint32_t score;
 	uint32_t trail;
-	uint32_t index;
+	uint64_t index;
 	uint32_t size;
+	/* START_BITS of bytes where a fuzzy term may start matching, learned by
+	 * the DP. All ones until then. */
+	uint32_t starts;
+	uint8_t const *str;
+	/* Ignore bitmap, followed by the string itself unless it is mapped. */
 	uint8_t bytes[];
 };
 
+/* Index file starts with this, followed by records in their in-memory layout
+ * except that str is an offset into input. */
+struct index_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t delim;
+	/* Identity of input. */
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t offset;
+	uint64_t nb_records;
+};
+
+/* Items a pool thread has left. Others steal from the end. */
+struct worker {
+	pthread_mutex_t lock;
+	uint32_t from;
+	uint32_t to;
+};
+
+/* Sort key of a match, as packed by sort_records(). */
+struct hit {
+	uint64_t hi;
+	uint64_t lo;
+};
+
+/* Connection of a client to the server. */
+struct client {
+	int fd;
+	size_t size;
+	char buf[2 * QUERY_SIZE];
+};
+
+/* Records are packed one after the other into large chunks. */
+struct chunk {
+	struct chunk *next;
+	size_t size;
+	size_t used;
+	alignas(struct record) uint8_t bytes[];
+};
+
+/* What a main loop iteration spent its time on. */
+struct frame {
+	double score_msec;
+	double sort_msec;
+	double print_msec;
+	double readline_msec;
+	/* Records given to score_record()... */
+	uint64_t nb_scanned;
+	/* ...rejected before the DP... */
+	uint64_t nb_rejected;
+	/* ...and scored by the DP. */
+	uint64_t nb_dp;
+};
+
+/* Row of the screen below prompt. */
+struct row {
+	/* Shown record or NULL. */
+	struct record const *record;
+	char *bytes;
+	size_t size;
+};
+
+/* Scoring state of a previous query. */
+struct snapshot {
+	struct snapshot *next;
+	char query[QUERY_SIZE + 1 /* NUL */];
+	uint32_t nb_matches;
+	uint32_t nb_candidates;
+	uint32_t nb_sorted;
+	struct {
+		struct record *record;
+		uint32_t score;
+		uint32_t trail;
+	} candidates[];
+};
+
+/* Records matched when the filter was narrowed to them. */
+struct level {
+	struct level *next;
+	char query[QUERY_SIZE + 1 /* NUL */];
+	uint32_t nb_records;
+	uint32_t nb_matches;
+	uint32_t nb_candidates;
+	uint32_t nb_sorted;
+	struct {
+		struct record *record;
+		uint32_t score;
+		uint32_t trail;
+	} matches[];
+};
+
+enum term_kind {
+	TERM_FUZZY,
+	TERM_EXACT,
+	TERM_PREFIX,
+	TERM_SUFFIX,
+	TERM_EQUAL,
+};
+
+/* Space separated part of a query. */
+struct term {
+	enum term_kind kind;
+	bool negate;
+	uint32_t size;
+	char const *str;
+};
+
+/* Terms of a query, cheapest and most selective first. */
+struct query {
+	uint32_t nb_terms;
+	struct term terms[(QUERY_SIZE + 1) / 2];
+	char bytes[QUERY_SIZE + 1 /* NUL */];
+};
+
 enum char_class {
 	CC_NONE,
 	CC_FIELD_BREAK,
@@ -81,22 +249,94 @@ static char const *opt_hi_end = "\033[27m";
 static char const *opt_execute = "";
 static char opt_query[QUERY_SIZE + 1 /* NUL */];
 static char opt_delim = '\n';
+/* Lowered only to test wide records cheaply. */
+static size_t wide_size = WIDE_SIZE;
+static size_t dp_window = DP_WINDOW;
 static bool opt_interactive = true;
+static bool opt_stream = false;
 static bool opt_sort = true;
 static bool opt_prefix_alpha = false;
 static bool opt_print_changes = false;
 static bool opt_print_indices = false;
 static bool opt_auto_accept_only = false;
+static bool opt_benchmark = false;
+static bool opt_show_stats = false;
+static int opt_stats_fd = -1;
 static int opt_lines = 0;
+static size_t opt_cache_size = (size_t)64 << 20;
+static uint32_t opt_nb_threads = 0;
+static char const *opt_serve = NULL;
+static char const *opt_batch = NULL;
+static char const *opt_connect = NULL;
+static char const *opt_index = NULL;
 
 static FILE *tty;
 
 static uint32_t nb_total_records, nb_records, nb_matches;
+/* records[nb_matches..nb_candidates) passed only the filters of the query. */
+static uint32_t nb_candidates;
+/* records[nb_scored..nb_records) arrived after scoring started. */
+static uint32_t nb_scored;
+/* records[job_from..job_to) are still to be scored for cur_query. Between
+ * candidates and them and after them there are only non-candidates. */
+static uint32_t job_from, job_to;
+/* records[0..nb_sorted) are the best matches in order. */
+static uint32_t nb_sorted;
 static bool records_changed;
 static struct record **records;
-/* [c]= (1 << i0) | ... <=> q[i0] matches (==) c */
-static uint32_t qmat[UINT8_MAX + 1];
+/* Most recent first. Owned by whoever reads records. */
+static struct chunk *chunks;
+/* Input file records point into. */
+static void *input_map;
+static size_t input_mapsz;
+/* Index file records live in. */
+static void *index_map;
+static size_t index_mapsz;
+static pthread_t reader_thread;
+static bool reading;
+/* Records read and printed in streaming mode. */
+static uint64_t nb_streamed, nb_emitted;
+/* Records read but not yet seen by the main thread. */
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct record **pending;
+static uint32_t nb_pending, pending_size;
+/* Threads of the pool live across parallel_for() calls. Only the main thread
+ * may call it. */
+static uint32_t nb_threads;
+static struct worker *workers;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static uint64_t pool_generation;
+static uint32_t pool_nb_busy;
+static void (*pool_fn)(void *arg, uint32_t from, uint32_t to);
+static void *pool_arg;
+static struct record *const *pool_weights;
+static bool reader_done;
+/* Reader thread notifies main loop about pending records. */
+static int reader_pipe[2] = { -1, -1 };
 static char cur_query[sizeof opt_query];
+static struct query query;
+/* [term][c]= (1 << i0) | ... <=> term[i0] matches (==) c */
+static uint64_t (*qmats)[UINT8_MAX + 1][MASK_WORDS];
+/* Most recently used first. */
+static struct snapshot *snapshots;
+static size_t snapshots_size;
+/* Stack of filters, innermost first. */
+static struct level *levels;
+/* What is on the screen: header, then records. Zero rows means unknown. */
+static struct row *screen;
+static uint32_t nb_screen_rows, screen_capacity;
+static int screen_height, screen_width;
+/* Query records on the screen were highlighted for. */
+static char screen_query[sizeof opt_query];
+/* Row being rendered. */
+static char *line;
+static size_t line_size, line_capacity;
+static struct frame frame, last_frame;
+/* Completed frames, only if they are written out at exit. */
+static struct frame *frames;
+static uint32_t nb_frames;
 
 static uint8_t const CLASSIFY[] = {
 #define xmacro(c) \
@@ -123,6 +363,16 @@ static uint8_t const CLASSIFY[] = {
 #undef xmacro
 };
 
+/* Letters of both cases share a bit, other bytes share the rest. */
+static uint32_t const START_BITS[] = {
+#define xmacro(c) \
+	(uint32_t)1 << ( \
+	'a' <= ((c) | ' ') && ((c) | ' ') <= 'z' ? ((c) | ' ') - 'a' : \
+	26 + (c) % 6),
+	REPEAT256(0)
+#undef xmacro
+};
+
 #define CC_MKBIT2(prev_cc, cur_cc) \
 	(1UL << ((prev_cc) * CC_NB + (cur_cc)))
 
@@ -182,9 +432,19 @@ static uint8_t const BONUS[CC_NB][CC_NB] = {
 };
 #pragma GCC diagnostic pop
 
+static double
+get_msec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
 static void
 setup_term(void)
 {
+	nb_screen_rows = 0;
+
 	/* Disable wrapping. */
 	fputs("\033[?7l", tty);
 	if (!opt_lines)
@@ -201,34 +461,118 @@ reset_term(void)
 	fflush(tty);
 }
 
+/* Bytes occupied by a record of size. */
+static size_t
+record_size(size_t size, bool mapped)
+{
+	size_t allocsz = offsetof(struct record, bytes) + BITS_SIZE(size) + (mapped ? 0 : size);
+	if (wide_size <= size)
+		allocsz += sizeof(uint64_t);
+	return (allocsz + alignof(struct record) - 1) & ~(alignof(struct record) - 1);
+}
+
+static size_t
+get_size(struct record const *record)
+{
+	if (WIDE_SIZE != record->size)
+		return record->size;
+
+	uint64_t size;
+	memcpy(&size, (uint64_t const *)record - 1, sizeof size);
+	return size;
+}
+
+/* Set up header of a record of size allocated at p. */
+static struct record *
+place_record(void *p, size_t size)
+{
+	struct record *record = p;
+	if (wide_size <= size) {
+		uint64_t wide = size;
+		memcpy(p, &wide, sizeof wide);
+		record = (struct record *)((uint64_t *)p + 1);
+		size = WIDE_SIZE;
+	}
+	record->size = size;
+	record->starts = UINT32_MAX;
+	return record;
+}
+
+static void *
+alloc_record(size_t size)
+{
+	struct chunk *chunk = chunks;
+	if (!chunk || chunk->size - chunk->used < size) {
+		size_t chunksz = CHUNK_SIZE < size ? size : CHUNK_SIZE;
+		chunk = malloc(offsetof(struct chunk, bytes[chunksz]));
+		if (!chunk)
+			abort();
+		chunk->size = chunksz;
+		chunk->used = 0;
+
+		/* Do not waste space left in current chunk due to a huge
+		 * record. */
+		if (chunks && CHUNK_SIZE < size) {
+			chunk->next = chunks->next;
+			chunks->next = chunk;
+		} else {
+			chunk->next = chunks;
+			chunks = chunk;
+		}
+	}
+
+	void *ret = chunk->bytes + chunk->used;
+	chunk->used += size;
+	return ret;
+}
+
+static void
+free_chunks(struct chunk *chunk)
+{
+	while (chunk) {
+		struct chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+}
+
 static void
 clear_records(void)
 {
-	for (uint32_t i = 0; i < nb_total_records; ++i)
-		free(records[i]);
+	free_chunks(chunks);
+	chunks = NULL;
 	free(records);
 	records = NULL;
+	if (input_map) {
+		munmap(input_map, input_mapsz);
+		input_map = NULL;
+	}
+	if (index_map) {
+		munmap(index_map, index_mapsz);
+		index_map = NULL;
+	}
 	nb_total_records = 0;
+	nb_records = 0;
+	nb_matches = 0;
+	nb_candidates = 0;
+	nb_scored = 0;
+	records_changed = true;
+	/* Rows refer to records. */
+	nb_screen_rows = 0;
 }
 
+/* Mark control characters and SGR sequences starting at byte from, which must
+ * be a multiple of CHAR_BIT outside of any escape sequence. */
 static void
-add_record(char const *pre, size_t presz, char const *buf, size_t bufsz)
+mark_ignored_from(struct record *record, size_t from)
 {
-	uint32_t sz = presz + bufsz;
-	uint32_t allocsz = offsetof(struct record, bytes[BITS_SIZE(sz) + sz]);
-	struct record *record = malloc(allocsz);
-	if (!record)
-		abort();
+	uint8_t const *str = record->str;
+	size_t sz = get_size(record);
 
-	record->index = nb_total_records;
-	record->size = sz;
-	memset(record->bytes, 0, BITS_SIZE(sz));
-	uint8_t *str = record->bytes + BITS_SIZE(sz);
-	memcpy(str, pre, presz);
-	memcpy(record->bytes + BITS_SIZE(sz) + presz, buf, bufsz);
+	memset(record->bytes + from / CHAR_BIT, 0, BITS_SIZE(sz) - from / CHAR_BIT);
 
 	bool escape = false;
-	for (uint32_t i = 0; i < sz; ++i) {
+	for (size_t i = from; i < sz; ++i) {
 		uint8_t c = str[i];
 
 		escape |= ('[' - '@') == c;
@@ -240,40 +584,142 @@ add_record(char const *pre, size_t presz, char const *buf, size_t bufsz)
 		/* End of SGR sequence. */
 		escape &= 'm' != c;
 	}
+}
+
+static void
+mark_ignored_scalar(struct record *record)
+{
+	mark_ignored_from(record, 0);
+}
+
+#if WITH_X86
+/* Control characters are c <= 0x1f except the classified ones. Blocks are
+ * done in bulk until the first ESC, rest of the record goes the slow way. */
+# define MARK_IGNORED_SIMD(name, isa, bits, vec, set1, cmpeq, max, movemask) \
+__attribute__((target(isa))) \
+static void \
+name(struct record *record) \
+{ \
+	uint8_t const *str = record->str; \
+	size_t n = get_size(record); \
+	vec esc = set1('[' - '@'); \
+	vec ctl = set1(' ' - 1); \
+	vec nul = set1('\0'); \
+	vec tab = set1('\t'); \
+	vec us = set1('_' - '@'); \
+ \
+	size_t i = 0; \
+	for (; i + bits <= n; i += bits) { \
+		vec v; \
+		memcpy(&v, str + i, sizeof v); \
+		if (movemask(cmpeq(v, esc))) \
+			break; \
+ \
+		uint##bits##_t control = movemask(cmpeq(max(v, ctl), ctl)); \
+		control &= ~(uint##bits##_t)movemask(cmpeq(v, nul)); \
+		control &= ~(uint##bits##_t)movemask(cmpeq(v, tab)); \
+		control &= ~(uint##bits##_t)movemask(cmpeq(v, us)); \
+		memcpy(record->bytes + i / CHAR_BIT, &control, sizeof control); \
+	} \
+	mark_ignored_from(record, i); \
+}
+
+MARK_IGNORED_SIMD(mark_ignored_sse2, "sse2", 16, __m128i,
+		_mm_set1_epi8, _mm_cmpeq_epi8, _mm_max_epu8, _mm_movemask_epi8)
+MARK_IGNORED_SIMD(mark_ignored_avx2, "avx2", 32, __m256i,
+		_mm256_set1_epi8, _mm256_cmpeq_epi8, _mm256_max_epu8, _mm256_movemask_epi8)
+
+# undef MARK_IGNORED_SIMD
+#endif
+
+static void (*mark_ignored)(struct record *record) = mark_ignored_scalar;
+
+static struct record *
+new_record(char const *pre, size_t presz, char const *buf, size_t bufsz)
+{
+	size_t sz = presz + bufsz;
+	struct record *record = place_record(alloc_record(record_size(sz, false)), sz);
+
+	uint8_t *str = record->bytes + BITS_SIZE(sz);
+	memcpy(str, pre, presz);
+	memcpy(str + presz, buf, bufsz);
+	record->str = str;
+
+	return record;
+}
+
+static struct record *
+new_mapped_record(uint8_t const *buf, size_t bufsz)
+{
+	struct record *record = place_record(alloc_record(record_size(bufsz, true)), bufsz);
+
+	record->str = buf;
+
+	return record;
+}
+
+static void
+append_record(struct record *record)
+{
+	/* Records in memory are counted in 32 bits. Streaming mode forgets
+	 * them, so it has no such limit. */
+	if (UINT32_MAX == nb_total_records) {
+		fputs("Too many records\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	record->index = nb_total_records;
 
 	/* Allocate 2^x sizes. */
 	if (!(nb_total_records & (nb_total_records - 1))) {
-		uint32_t nb_next = 2 * nb_total_records + !nb_total_records;
+		size_t nb_next = 2 * (size_t)nb_total_records + !nb_total_records;
 		records = realloc(records, nb_next * sizeof *records);
 		if (!records)
 			abort();
 	}
+	/* Unfiltered view grows with input. Filters keep their records even
+	 * if they happen to contain all of them. */
+	if (!levels)
+		++nb_records;
 	records[nb_total_records++] = record;
-
-	records_changed = true;
 }
 
+/* Copy records[0..n) to new chunks and free all other records. */
 static void
-score_record(struct record *record, uint32_t *positions, uint32_t nb_positions)
+keep_records(uint32_t n)
 {
-	record->score = 0;
-	record->trail = 0;
+	struct chunk *old = chunks;
+	chunks = NULL;
+	for (uint32_t i = 0; i < n; ++i) {
+		struct record *record = records[i];
+		size_t sz = get_size(record);
+		struct record *copy = place_record(alloc_record(record_size(sz, false)), sz);
+		memcpy(copy, record, offsetof(struct record, bytes[BITS_SIZE(sz) + sz]));
+		copy->str = copy->bytes + BITS_SIZE(sz);
+		records[i] = copy;
+	}
+	free_chunks(old);
 
-	uint32_t out_position = 0;
-	if (nb_positions)
-		positions[0] = UINT32_MAX;
+	nb_total_records = n;
+	nb_records = n;
+	nb_matches = n;
+	nb_candidates = n;
+	nb_sorted = 0;
+}
 
-	uint32_t n = record->size;
-	uint8_t const *str = record->bytes + BITS_SIZE(record->size);
+/* Test whether query is a subsequence of record. */
+static bool
+match_memchr(struct record const *record, char const *query)
+{
+	uint8_t const *str = record->str;
 
-	uint32_t m = 0;
-	for (uint8_t const *q = (uint8_t *)opt_query,
+	for (uint8_t const *q = (uint8_t *)query,
 	     *ptr = str,
-	     *end = ptr + n;
+	     *end = ptr + get_size(record);
 	     *q;
-	     ++q, ++m)
+	     ++q)
 	{
-		for (uint32_t i;;) {
+		for (size_t i;;) {
 			uint8_t const *p = memchr(ptr, *q, end - ptr);
 
 			if ('a' <= *q && *q <= 'z') {
@@ -283,7 +729,7 @@ score_record(struct record *record, uint32_t *positions, uint32_t nb_positions)
 			} else
 				ptr = p;
 			if (!ptr)
-				return;
+				return false;
 
 			i = ptr - str;
 			++ptr;
@@ -293,10 +739,287 @@ score_record(struct record *record, uint32_t *positions, uint32_t nb_positions)
 		}
 	}
 
-	if (!m) {
-		record->score = UINT32_MAX;
+	return true;
+}
+
+#if WITH_X86
+/* Lowercase letter matches both cases: c | ' ' == q. */
+# define MATCH_SIMD(name, isa, bits, vec, set1, or, cmpeq, movemask) \
+__attribute__((target(isa))) \
+static bool \
+name(struct record const *record, char const *query) \
+{ \
+	uint8_t const *q = (uint8_t *)query; \
+	if (!*q) \
+		return true; \
+ \
+	uint8_t const *str = record->str; \
+	size_t n = get_size(record); \
+	vec qor = set1('a' <= *q && *q <= 'z' ? ' ' : 0); \
+	vec qeq = set1(*q); \
+ \
+	for (size_t i = 0; i < n; i += bits) { \
+		vec v; \
+		uint##bits##_t ignore = 0; \
+		if (i + bits <= n) { \
+			memcpy(&v, str + i, sizeof v); \
+			memcpy(&ignore, record->bytes + i / CHAR_BIT, sizeof ignore); \
+		} else { \
+			memset(&v, 0, sizeof v); \
+			memcpy(&v, str + i, n - i); \
+			memcpy(&ignore, record->bytes + i / CHAR_BIT, BITS_SIZE(n - i)); \
+			ignore |= (uint##bits##_t)~0 << (n - i); \
+		} \
+ \
+		uint##bits##_t mask = ~ignore; \
+		for (uint##bits##_t mat; \
+		     (mat = mask & (uint##bits##_t)movemask(cmpeq(or(v, qor), qeq)));) \
+		{ \
+			if (!*++q) \
+				return true; \
+			qor = set1('a' <= *q && *q <= 'z' ? ' ' : 0); \
+			qeq = set1(*q); \
+			/* Continue after matching position. */ \
+			mask &= ~(mat ^ (mat - 1)); \
+		} \
+	} \
+ \
+	return false; \
+}
+
+MATCH_SIMD(match_sse2, "sse2", 16, __m128i,
+		_mm_set1_epi8, _mm_or_si128, _mm_cmpeq_epi8, _mm_movemask_epi8)
+MATCH_SIMD(match_avx2, "avx2", 32, __m256i,
+		_mm256_set1_epi8, _mm256_or_si256, _mm256_cmpeq_epi8, _mm256_movemask_epi8)
+
+# undef MATCH_SIMD
+#endif
+
+static bool (*match_query)(struct record const *record, char const *query) = match_memchr;
+
+static void
+setup_simd(void)
+{
+	/* Best available unless restricted. */
+	char const *simd = getenv("FIZZY_SIMD");
+	if (!simd)
+		simd = "";
+	(void)simd;
+
+#if WITH_X86
+	__builtin_cpu_init();
+	if (strcmp(simd, "none") &&
+	    __builtin_cpu_supports("sse2"))
+	{
+		match_query = match_sse2;
+		mark_ignored = mark_ignored_sse2;
+	}
+	if (strcmp(simd, "none") && strcmp(simd, "sse2") &&
+	    __builtin_cpu_supports("avx2"))
+	{
+		match_query = match_avx2;
+		mark_ignored = mark_ignored_avx2;
+	}
+#endif
+}
+
+static void
+setup_wide(void)
+{
+	char const *s = getenv("FIZZY_WIDE_SIZE");
+	if (!s)
+		return;
+
+	char *end;
+	errno = 0;
+	unsigned long long n = strtoull(s, &end, 10);
+	if (errno || !*s || *end || !n || WIDE_SIZE < n)
 		return;
+
+	wide_size = n;
+	if (wide_size < dp_window)
+		dp_window = wide_size;
+}
+
+static int
+term_cost(struct term const *term)
+{
+	switch (term->kind) {
+	case TERM_FUZZY:
+		return 3;
+	case TERM_EXACT:
+		return 1 + term->negate;
+	default:
+		return 0;
+	}
+}
+
+/* Cheaper first, then longer since it is likely to reject more. */
+static int
+compare_terms(void const *px, void const *py)
+{
+	struct term const *x = px;
+	struct term const *y = py;
+	int cmp;
+
+	cmp = COMPARE(term_cost(x), term_cost(y));
+	if (cmp)
+		return cmp;
+
+	cmp = COMPARE(x->size, y->size);
+	if (cmp)
+		return -cmp;
+
+	return COMPARE(x->str, y->str);
+}
+
+/* Split str into space separated terms:
+ *
+ * term   fuzzy
+ * 'term  exact
+ * ^term  prefix
+ * term$  suffix
+ * ^term$ whole record
+ * !term  negated, exact unless anchored
+ *
+ * "\ " stands for a literal space. */
+static void
+parse_query(struct query *query, char const *str)
+{
+	char *out = query->bytes;
+
+	query->nb_terms = 0;
+	for (;;) {
+		while (' ' == *str)
+			++str;
+		if (!*str)
+			break;
+
+		struct term term = { .kind = TERM_FUZZY };
+
+		if ('!' == *str) {
+			term.negate = true;
+			term.kind = TERM_EXACT;
+			++str;
+		}
+		if ('^' == *str) {
+			term.kind = TERM_PREFIX;
+			++str;
+		} else if ('\'' == *str && !term.negate) {
+			term.kind = TERM_EXACT;
+			++str;
+		}
+
+		term.str = out;
+		bool escaped = false;
+		for (; *str && ' ' != *str; ++str) {
+			escaped = '\\' == str[0] && ' ' == str[1];
+			str += escaped;
+			*out++ = *str;
+		}
+		if (term.str < out && '$' == out[-1] && !escaped) {
+			term.kind = TERM_PREFIX == term.kind ? TERM_EQUAL : TERM_SUFFIX;
+			--out;
+		}
+		term.size = out - term.str;
+		*out++ = '\0';
+
+		/* Lone "!", "^" and friends. */
+		if (!term.size) {
+			out = (char *)term.str;
+			continue;
+		}
+
+		query->terms[query->nb_terms++] = term;
+	}
+
+	qsort(query->terms, query->nb_terms, sizeof *query->terms, compare_terms);
+}
+
+/* Match term starting at position i, skipping ignored bytes. Return position
+ * after it or 0. */
+static size_t
+match_visible(struct record const *record, size_t i, struct term const *term,
+		uint32_t *positions)
+{
+	uint8_t const *q = (uint8_t const *)term->str;
+	size_t n = get_size(record);
+
+	for (uint32_t k = 0; k < term->size; ++i) {
+		if (n <= i)
+			return 0;
+		if (BIT_TEST(record->bytes, i))
+			continue;
+
+		uint8_t c = record->str[i];
+		if (!(q[k] == c || ('a' <= q[k] && q[k] <= 'z' && (q[k] ^ ' ') == c)))
+			return 0;
+
+		if (positions)
+			positions[k] = i;
+		++k;
+	}
+
+	if (positions)
+		positions[term->size] = UINT32_MAX;
+
+	return i;
+}
+
+/* Test whether record matches non-fuzzy term, ignoring negation. */
+static bool
+match_term(struct record const *record, struct term const *term, uint32_t *positions)
+{
+	size_t n = get_size(record);
+	size_t i;
+
+	switch (term->kind) {
+	case TERM_EXACT:
+		for (i = 0; i < n; ++i)
+			if (!BIT_TEST(record->bytes, i) &&
+			    match_visible(record, i, term, positions))
+				return true;
+		return false;
+
+	case TERM_PREFIX:
+	case TERM_EQUAL:
+		for (i = 0; i < n && BIT_TEST(record->bytes, i);)
+			++i;
+		i = match_visible(record, i, term, positions);
+		if (!i || TERM_PREFIX == term->kind)
+			return i;
+		while (i < n && BIT_TEST(record->bytes, i))
+			++i;
+		return i == n;
+
+	case TERM_SUFFIX:
+		i = n;
+		for (uint32_t k = 0; k < term->size; k += !BIT_TEST(record->bytes, i))
+			if (!i--)
+				return false;
+		return match_visible(record, i, term, positions);
+
+	default:
+		abort();
 	}
+}
+
+/* Bit i of a query mask. */
+#define MASK_TEST(mask, i) (((mask)[(i) / MASK_BITS] >> ((i) % MASK_BITS)) & 1)
+
+/* Body of score_record() for queries of at most nb_words * MASK_BITS bytes.
+ * Always inlined with constant nb_words so loops over mask words vanish, and
+ * with constant paths so that scoring alone does not pay for tracking matched
+ * positions. Constant wide selects scoring wide records in windows of
+ * dp_window bytes, so positions stay 32-bit for all other records. */
+__attribute__((always_inline))
+static inline void
+score_record_masks(struct record *record, uint32_t *positions, uint32_t nb_positions,
+		uint64_t (*qmat)[MASK_WORDS], uint32_t m, uint32_t const nb_words,
+		bool const paths, bool const wide)
+{
+	uint32_t out_position = 0;
+	size_t size = wide ? get_size(record) : record->size;
 
 	/*
 	 *  subject string
@@ -309,7 +1032,7 @@ score_record(struct record *record, uint32_t *positions, uint32_t nb_positions)
 
 	/* [i][i]=Matching position of the maximum for query[i].
 	 * [i][j<i]=Path to [i][i]. */
-	uint32_t max_paths[QUERY_SIZE - 1][QUERY_SIZE];
+	uint32_t max_paths[paths ? nb_words * MASK_BITS - 1 : 1][paths ? nb_words * MASK_BITS : 1];
 	/* [i]=Best score for the i-long prefix. Off by one so we need one more
 	 * element.
 	 *
@@ -319,231 +1042,1351 @@ score_record(struct record *record, uint32_t *positions, uint32_t nb_positions)
 	 *
 	 * To avoid decrementing max_scores[..] on every output byte, max_score
 	 * is transformed using output index. */
-	uint32_t max_scores[QUERY_SIZE + 1];
+	uint32_t max_scores[nb_words * MASK_BITS + 1];
 	/* Bonus for the maximum. */
-	uint32_t max_bonuses[QUERY_SIZE + 1];
+	uint32_t max_bonuses[nb_words * MASK_BITS + 1];
 	/* Bonus for continuation. */
-	uint32_t cont_bonuses[QUERY_SIZE + 1];
+	uint32_t cont_bonuses[nb_words * MASK_BITS + 1];
 
-	memset(max_scores, 0, sizeof max_scores);
-	memset(max_bonuses, 0, sizeof max_bonuses);
-	memset(cont_bonuses, 0, sizeof cont_bonuses);
+	/* Elements after m are never read. */
+	memset(max_scores, 0, (m + 1) * sizeof *max_scores);
+	memset(max_bonuses, 0, (m + 1) * sizeof *max_bonuses);
+	memset(cont_bonuses, 0, (m + 1) * sizeof *cont_bonuses);
 
 	enum char_class prev_cc = CC_FIELD_BREAK;
-	uint32_t prev_mat = 0;
+	uint64_t prev_mat[nb_words];
+	uint32_t starts = 0;
 	uint32_t max_score = 0;
-	uint32_t latest_pos = 0;
+	size_t latest_pos = 0;
 	uint32_t k = 0; /* Query prefix length. */
 	uint32_t o = 0; /* Output byte index. */
 
-	dbgf(stderr, "%.*s\n", n, str);
-
-	for (uint32_t i = 0; i < n; ++i) {
-		/* Test ignored input position. */
-		if (BIT_TEST(record->bytes, i))
-			continue;
+	memset(prev_mat, 0, sizeof prev_mat);
 
-		++o;
+	for (size_t base = 0; base < size; base += wide ? dp_window : size) {
+		uint32_t n = wide && dp_window < size - base ? dp_window : size - base;
+		uint8_t const *str = record->str + base;
+		uint8_t const *bytes = record->bytes + base / CHAR_BIT;
 
-		uint8_t c = str[i];
-		enum char_class cc = CLASSIFY[c];
-
-		uint32_t mat = qmat[c];
-		/* Disallow matches outside the k-length prefix. */
-		mat &= (2 << k) - 1;
-		/* Test if position is dynamically ignored. */
-		uint32_t t = (prev_mat << 1) | prev_mat;
-		if (!(CC_MKBIT2(prev_cc, cc) & IGNORE_NONMATCHING))
-			t = ~0;
-		mat &= t;
-		if (!mat) {
-			prev_mat = 0;
-			prev_cc = cc;
-			continue;
+		/* Make output index start over. Scores that faded away stay so. */
+		if (wide && base) {
+			for (uint32_t j = 0; j <= m; ++j)
+				max_scores[j] = o < max_scores[j] ? max_scores[j] - o : 0;
+			o = 0;
 		}
 
-		uint32_t cont_mat = prev_mat;
-		prev_mat = mat;
+		dbgf(stderr, "%.*s\n", n, str);
 
-		uint32_t bonus = BONUS[prev_cc][cc];
-		prev_cc = cc;
+		for (uint32_t i = 0; i < n; ++i) {
+			/* Test ignored input position. */
+			if (BIT_TEST(bytes, i))
+				continue;
 
-		/* Allow matching next byte from query when complete prefix has
-		 * been matched. This ensures that a later byte in the query
-		 * cannot be matched without requiring all preceding bytes to
-		 * be matched (at least once). */
-		k += (mat >> k) && k + 1 < m;
+			++o;
+
+			uint8_t c = str[i];
+			enum char_class cc = CLASSIFY[c];
+
+			/* Test if position is dynamically ignored. */
+			bool ignoring = CC_MKBIT2(prev_cc, cc) & IGNORE_NONMATCHING;
+			if (!ignoring)
+				starts |= START_BITS[c];
+
+			uint64_t mat[nb_words];
+			uint64_t any = 0;
+			for (uint32_t w = 0; w < nb_words; ++w) {
+				mat[w] = qmat[c][w];
+				/* Disallow matches outside the k-length prefix. */
+				if (k < w * MASK_BITS)
+					mat[w] = 0;
+				else if (k - w * MASK_BITS < MASK_BITS - 1)
+					mat[w] &= ((uint64_t)2 << (k - w * MASK_BITS)) - 1;
+				if (ignoring)
+					mat[w] &= (prev_mat[w] << 1) | prev_mat[w] |
+						(0 < w ? prev_mat[w - 1] >> (MASK_BITS - 1) : 0);
+				any |= mat[w];
+			}
+			if (!any) {
+				memset(prev_mat, 0, sizeof prev_mat);
+				prev_cc = cc;
+				continue;
+			}
 
-		/* Go backwards so we can see the previous state of an upper
-		 * cell. */
-		for (uint32_t j;
-		     mat && (j = 31 ^ __builtin_clz(mat), 1);
-		     mat ^= 1 << j)
-		{
-			uint32_t score;
+			uint64_t cont_mat[nb_words];
+			memcpy(cont_mat, prev_mat, sizeof cont_mat);
+			memcpy(prev_mat, mat, sizeof prev_mat);
 
-			score = o < max_scores[j]
-				? max_scores[j] - o
-				: 0;
+			uint32_t bonus = BONUS[prev_cc][cc];
+			prev_cc = cc;
 
-			/* Prefer match of the same kind. A kind of distant
-			 * continuation. */
-			if (score /* Not too far. */ && bonus == max_bonuses[j])
+			/* Allow matching next byte from query when complete prefix has
+			 * been matched. This ensures that a later byte in the query
+			 * cannot be matched without requiring all preceding bytes to
+			 * be matched (at least once). */
+			k += MASK_TEST(mat, k) && k + 1 < m;
+
+			/* Go backwards so we can see the previous state of an upper
+			 * cell. */
+			for (uint32_t w = nb_words; 0 < w--;)
+			for (uint32_t j;
+			     mat[w] && (j = w * MASK_BITS + (63 ^ __builtin_clzll(mat[w])), 1);
+			     mat[w] ^= (uint64_t)1 << (j % MASK_BITS))
+			{
+				uint32_t score;
+
+				score = o < max_scores[j]
+					? max_scores[j] - o
+					: 0;
+
+				/* Prefer match of the same kind. A kind of distant
+				 * continuation. */
+				if (score /* Not too far. */ && bonus == max_bonuses[j])
+					score += bonus;
+
+				/* Bonus for matching this particular position. */
 				score += bonus;
 
-			/* Bonus for matching this particular position. */
-			score += bonus;
-
-			/* Bonus for contiguous match. Take the better since
-			 * we may have a continuation over a position that has
-			 * a higher bonus (xaBcx). */
-			uint32_t cont_bonus = cont_bonuses[j];
-			if (cont_bonus < bonus)
-				cont_bonus = bonus;
-			/* Increase bonus so longer wins. */
-			cont_bonus += 1;
-			cont_bonuses[j + 1] = cont_bonus;
-			/* New test that cont_bonus is really applicable. */
-			if (!((cont_mat << 1) & (1 << j)))
-				cont_bonus = 0;
-			score += cont_bonus;
-
-			dbgf(stderr, "%*.s%c:%*.sj=%2d/%-2d m=%-4u b=%-4u cm=%-4u cb=%-4u => %-4u %s\n",
-					i, "", c,
-					80 - i, "",
-					j, k,
-					max_scores[j],
-					bonus,
-					max_bonuses[j] == bonus ? max_bonuses[j] : 0,
-					cont_bonus,
-					score,
-					o + score <= max_scores[j + 1] ? "" : "MAX");
-
-			if (j + 1 == m) {
-				latest_pos = i;
-				if (nb_positions) {
-					/* Reserve space for highest quality match. */
-					uint32_t tmp = nb_positions - (
-							j + /* Previous values. */
-							1 + /* This one. */
-							1 /* End marker. */
-					);
-					if (tmp < out_position)
-						out_position = tmp;
-
-					/* Append new positions. Old ones are already included
-					 * in positions list because i is strict monotonic
-					 * increasing. */
-					uint32_t skip = 0;
-					while (0 < out_position &&
-					       skip < j &&
-					       max_paths[j - 1][skip] <= positions[out_position - 1])
-						++skip;
-
-					memcpy(positions + out_position, max_paths[j - 1] + skip,
-							(j - skip) * sizeof **max_paths);
-					out_position += j - skip;
-					positions[out_position] = i;
-					out_position += 1;
+				/* Bonus for contiguous match. Take the better since
+				 * we may have a continuation over a position that has
+				 * a higher bonus (xaBcx). */
+				uint32_t cont_bonus = cont_bonuses[j];
+				if (cont_bonus < bonus)
+					cont_bonus = bonus;
+				/* Increase bonus so longer wins. */
+				cont_bonus += 1;
+				cont_bonuses[j + 1] = cont_bonus;
+				/* New test that cont_bonus is really applicable. */
+				if (!(0 < j && MASK_TEST(cont_mat, j - 1)))
+					cont_bonus = 0;
+				score += cont_bonus;
+
+				dbgf(stderr, "%*.s%c:%*.sj=%2d/%-2d m=%-4u b=%-4u cm=%-4u cb=%-4u => %-4u %s\n",
+						i, "", c,
+						80 - i, "",
+						j, k,
+						max_scores[j],
+						bonus,
+						max_bonuses[j] == bonus ? max_bonuses[j] : 0,
+						cont_bonus,
+						score,
+						o + score <= max_scores[j + 1] ? "" : "MAX");
+
+				if (j + 1 == m) {
+					latest_pos = base + i;
+					if (paths) {
+						/* Reserve space for highest quality match. */
+						uint32_t tmp = nb_positions - (
+								j + /* Previous values. */
+								1 + /* This one. */
+								1 /* End marker. */
+						);
+						if (tmp < out_position)
+							out_position = tmp;
+
+						/* Append new positions. Old ones are already included
+						 * in positions list because i is strict monotonic
+						 * increasing. */
+						uint32_t skip = 0;
+						while (0 < out_position &&
+						       skip < j &&
+						       max_paths[j - 1][skip] <= positions[out_position - 1])
+							++skip;
+
+						memcpy(positions + out_position, max_paths[j - 1] + skip,
+								(j - skip) * sizeof **max_paths);
+						out_position += j - skip;
+						positions[out_position] = i;
+						out_position += 1;
+					}
 				}
-			}
 
-			if (o + score <= max_scores[j + 1])
-				continue;
-			max_scores[j + 1] = o + score;
-			max_bonuses[j + 1] = bonus;
-
-			if (j + 1 < m) {
-				/* Only the first `j * sizeof(uint32_t)` bytes
-				 * are needed but it's faster with known size. */
-				if (0 < j)
-					memcpy(max_paths[j], max_paths[j - 1],
-							sizeof *max_paths);
-				max_paths[j][j] = i;
-				continue;
-			}
+				if (o + score <= max_scores[j + 1])
+					continue;
+				max_scores[j + 1] = o + score;
+				max_bonuses[j + 1] = bonus;
+
+				if (j + 1 < m) {
+					if (!paths)
+						continue;
+					/* Only the first `j * sizeof(uint32_t)` bytes
+					 * are needed but it's faster with known size. */
+					if (0 < j)
+						memcpy(max_paths[j], max_paths[j - 1],
+								sizeof *max_paths);
+					max_paths[j][j] = i;
+					continue;
+				}
 
-			if (max_score < score) {
-				max_score = score;
-				dbgf(stderr, "new_max=%u\n", max_score);
+				if (max_score < score) {
+					max_score = score;
+					dbgf(stderr, "new_max=%u\n", max_score);
+				}
 			}
 		}
 	}
 
 	dbgf(stderr, " ==> %u\n\n", max_score);
 
-	if (nb_positions)
+	if (paths)
 		positions[out_position] = UINT32_MAX;
 
 	record->score = max_score;
-	record->trail = n - latest_pos;
+	record->trail = wide && UINT32_MAX < size - latest_pos
+		? UINT32_MAX
+		: size - latest_pos;
+	record->starts = starts;
 }
 
-static void
-score_all(void)
+/* Return whether the DP ran. */
+static bool
+score_term(struct record *record, uint32_t *positions, uint32_t nb_positions,
+		struct term const *term, uint64_t (*qmat)[MASK_WORDS])
 {
-	bool subquery = strstr(opt_query, cur_query);
-	uint32_t n = !records_changed && subquery ? nb_matches : nb_records;
-	memcpy(cur_query, opt_query, sizeof cur_query);
+	uint32_t m = term->size;
 
-	memset(qmat, 0, sizeof qmat);
-	for (uint8_t m = 0, c; (c = opt_query[m]); ++m) {
-		qmat[c] |= 1 << m;
-		if ('a' <= c && c <= 'z')
-			qmat[c - 'a' + 'A'] |= 1 << m;
+	/* First byte can only match where it is not ignored, so DP would find
+	 * nothing. */
+	if (!(record->starts & START_BITS[(uint8_t)term->str[0]])) {
+		record->score = 0;
+		record->trail = record->size;
+		return false;
 	}
 
-#pragma omp parallel for schedule(dynamic)
-	for (uint32_t i = 0; i < n; ++i) {
-		struct record *record = records[i];
-		score_record(record, NULL, 0);
+	if (WIDE_SIZE == record->size) {
+		/* Wide records are rare and never highlighted, so one variant
+		 * for queries of any length does. */
+		if (nb_positions)
+			positions[0] = UINT32_MAX;
+		score_record_masks(record, NULL, 0, qmat, m, 4, false, true);
+	} else if (nb_positions) {
+		/* Positions are only wanted for highlighting visible records. */
+		if (m <= MASK_BITS)
+			score_record_masks(record, positions, nb_positions, qmat, m, 1, true, false);
+		else if (m <= 2 * MASK_BITS)
+			score_record_masks(record, positions, nb_positions, qmat, m, 2, true, false);
+		else
+			score_record_masks(record, positions, nb_positions, qmat, m, 4, true, false);
+	} else if (m <= MASK_BITS) {
+		score_record_masks(record, NULL, 0, qmat, m, 1, false, false);
+	} else if (m <= 2 * MASK_BITS) {
+		score_record_masks(record, NULL, 0, qmat, m, 2, false, false);
+	} else {
+		score_record_masks(record, NULL, 0, qmat, m, 4, false, false);
 	}
 
-	nb_matches = 0;
-	for (uint32_t i = 0; i < n; ++i) {
-		struct record *record = records[i];
-		if (!record->score)
-			continue;
+	return true;
+}
+
+/* Merge sorted positions into dst, keeping at most size - 1 of them. */
+static void
+merge_positions(uint32_t *dst, uint32_t size, uint32_t const *src)
+{
+	uint32_t merged[4 * QUERY_SIZE + 1];
+	uint32_t n = 0;
 
-		struct record *t = records[nb_matches];
-		records[nb_matches] = record;
-		records[i] = t;
-		++nb_matches;
+	if (sizeof merged / sizeof *merged < size)
+		size = sizeof merged / sizeof *merged;
+
+	for (uint32_t const *p = dst, *q = src;
+	     n + 1 < size && (UINT32_MAX != *p || UINT32_MAX != *q);)
+	{
+		if (*p < *q) {
+			merged[n++] = *p++;
+		} else {
+			p += *p == *q;
+			merged[n++] = *q++;
+		}
 	}
+	merged[n++] = UINT32_MAX;
 
-	records_changed = false;
+	memcpy(dst, merged, n * sizeof *dst);
 }
 
-static int
-compare_records(void const *px, void const *py)
+/* Score record for query whose terms have qmats. Return whether the DP had
+ * to run. */
+static bool
+score_record(struct record *record, struct query const *query,
+		uint64_t (*qmats)[UINT8_MAX + 1][MASK_WORDS],
+		uint32_t *positions, uint32_t nb_positions)
 {
-	struct record const *x = *(struct record **)px;
-	struct record const *y = *(struct record **)py;
-	int cmp;
+	uint32_t term_positions[4 * QUERY_SIZE + 1];
 
-	cmp = COMPARE(x->score, y->score);
-	if (cmp)
-		return -cmp;
+	record->score = 0;
+	record->trail = 0;
 
-	cmp = COMPARE(x->trail, y->trail);
-	if (cmp)
-		return cmp;
+	if (nb_positions)
+		positions[0] = UINT32_MAX;
 
-	cmp = COMPARE(x->size, y->size);
-	if (UINT32_MAX == x->score)
+	/* Reject as early as possible. Anchored terms are the cheapest, then
+	 * subsequence tests, substring searches and only then the DP. */
+	for (uint32_t t = 0; t < query->nb_terms; ++t) {
+		struct term const *term = &query->terms[t];
+		if (TERM_EXACT < term->kind &&
+		    match_term(record, term, NULL) == term->negate)
+			return false;
+	}
+
+	for (uint32_t t = 0; t < query->nb_terms; ++t) {
+		struct term const *term = &query->terms[t];
+		if (TERM_EXACT >= term->kind && !term->negate &&
+		    !match_query(record, term->str))
+			return false;
+	}
+
+	for (uint32_t t = 0; t < query->nb_terms; ++t) {
+		struct term const *term = &query->terms[t];
+		if (TERM_EXACT == term->kind &&
+		    match_term(record, term, NULL) == term->negate)
+			return false;
+	}
+
+	/* Only fuzzy terms are ranked. */
+	uint32_t score = UINT32_MAX;
+	uint32_t trail = 0;
+	bool dp = false;
+	for (uint32_t t = 0; t < query->nb_terms; ++t) {
+		struct term const *term = &query->terms[t];
+		if (TERM_FUZZY != term->kind)
+			continue;
+
+		dp |= score_term(record,
+				term_positions,
+				nb_positions ? sizeof term_positions / sizeof *term_positions : 0,
+				term, qmats[t]);
+		/* Remains a candidate. */
+		if (!record->score)
+			return dp;
+
+		if (UINT32_MAX == score) {
+			score = 0;
+			trail = UINT32_MAX;
+		}
+		score += record->score;
+		if (record->trail < trail)
+			trail = record->trail;
+
+		if (nb_positions)
+			merge_positions(positions, nb_positions, term_positions);
+	}
+
+	record->score = score;
+	record->trail = trail;
+
+	if (!nb_positions)
+		return dp;
+
+	for (uint32_t t = 0; t < query->nb_terms; ++t) {
+		struct term const *term = &query->terms[t];
+		if (TERM_FUZZY != term->kind && !term->negate &&
+		    match_term(record, term, term_positions))
+			merge_positions(positions, nb_positions, term_positions);
+	}
+
+	return dp;
+}
+
+static bool
+take_chunk(uint32_t self, uint32_t *from, uint32_t *to)
+{
+	struct worker *worker = &workers[self];
+
+	pthread_mutex_lock(&worker->lock);
+	uint32_t end = worker->from;
+	if (pool_weights) {
+		for (size_t bytes = 0; end < worker->to && bytes < POOL_CHUNK_BYTES; ++end)
+			bytes += POOL_RECORD_BYTES + pool_weights[end]->size;
+	} else if (end < worker->to) {
+		++end;
+	}
+	*from = worker->from;
+	*to = end;
+	worker->from = end;
+	pthread_mutex_unlock(&worker->lock);
+
+	return *from < *to;
+}
+
+/* Take over second half of items of another thread. */
+static bool
+steal_chunk(uint32_t self, uint32_t *from, uint32_t *to)
+{
+	for (uint32_t i = 1; i < nb_threads; ++i) {
+		struct worker *victim = &workers[(self + i) % nb_threads];
+
+		pthread_mutex_lock(&victim->lock);
+		uint32_t mid = victim->from + (victim->to - victim->from) / 2;
+		uint32_t end = victim->to;
+		victim->to = mid;
+		pthread_mutex_unlock(&victim->lock);
+
+		if (mid < end) {
+			struct worker *worker = &workers[self];
+			pthread_mutex_lock(&worker->lock);
+			worker->from = mid;
+			worker->to = end;
+			pthread_mutex_unlock(&worker->lock);
+			return take_chunk(self, from, to);
+		}
+	}
+
+	return false;
+}
+
+static void
+work(uint32_t self)
+{
+	uint32_t from, to;
+	while (take_chunk(self, &from, &to) || steal_chunk(self, &from, &to))
+		pool_fn(pool_arg, from, to);
+}
+
+static void *
+pool_thread(void *arg)
+{
+	uint32_t self = (uintptr_t)arg;
+	uint64_t generation = 0;
+
+	pthread_mutex_lock(&pool_lock);
+	for (;;) {
+		while (generation == pool_generation)
+			pthread_cond_wait(&pool_start, &pool_lock);
+		generation = pool_generation;
+		pthread_mutex_unlock(&pool_lock);
+
+		work(self);
+
+		pthread_mutex_lock(&pool_lock);
+		if (!--pool_nb_busy)
+			pthread_cond_signal(&pool_done);
+	}
+
+	return NULL;
+}
+
+static void
+start_pool(void)
+{
+	nb_threads = opt_nb_threads;
+	if (!nb_threads) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		nb_threads = 0 < n ? n : 1;
+	}
+
+	workers = calloc(nb_threads, sizeof *workers);
+	if (!workers)
+		abort();
+	for (uint32_t i = 0; i < nb_threads; ++i)
+		pthread_mutex_init(&workers[i].lock, NULL);
+
+	/* Calling thread is the first one. */
+	for (uint32_t i = 1; i < nb_threads; ++i) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, pool_thread, (void *)(uintptr_t)i))
+			abort();
+	}
+}
+
+/* Call fn for disjoint ranges that cover [0..n) on all threads. Ranges are
+ * records of about POOL_CHUNK_BYTES bytes if weights are given, single items
+ * otherwise. */
+static void
+parallel_for(uint32_t n, struct record *const *weights,
+		void (*fn)(void *arg, uint32_t from, uint32_t to), void *arg)
+{
+	if (!workers)
+		start_pool();
+
+	if (nb_threads <= 1 || n <= 1) {
+		if (n)
+			fn(arg, 0, n);
+		return;
+	}
+
+	/* Nobody touches them between calls. */
+	for (uint32_t i = 0; i < nb_threads; ++i) {
+		workers[i].from = (uint64_t)n * i / nb_threads;
+		workers[i].to = (uint64_t)n * (i + 1) / nb_threads;
+	}
+	pool_fn = fn;
+	pool_arg = arg;
+	pool_weights = weights;
+
+	pthread_mutex_lock(&pool_lock);
+	++pool_generation;
+	pool_nb_busy = nb_threads - 1;
+	pthread_cond_broadcast(&pool_start);
+	pthread_mutex_unlock(&pool_lock);
+
+	work(0);
+
+	pthread_mutex_lock(&pool_lock);
+	while (pool_nb_busy)
+		pthread_cond_wait(&pool_done, &pool_lock);
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/* Whether record passed the filters of the query during scoring. DP sets trail
+ * even if it finds no match. */
+static bool
+is_candidate(struct record const *record)
+{
+	return record->score || record->trail;
+}
+
+enum {
+	KIND_MATCH,
+	KIND_CANDIDATE,
+	/* Candidate the DP did not have to run for. */
+	KIND_SKIPPED,
+	KIND_OTHER,
+	KIND_NB,
+};
+
+/* What score_range() shares with pool threads. */
+struct score_work {
+	struct record **records;
+	uint32_t n;
+	uint8_t *kinds;
+	/* [block][kind]=Count, then output offset. */
+	uint32_t (*offsets)[KIND_NB];
+	struct record **scratch;
+};
+
+static void
+score_chunk(void *arg, uint32_t from, uint32_t to)
+{
+	struct score_work *w = arg;
+
+	for (uint32_t i = from; i < to; ++i) {
+		struct record *record = w->records[i];
+		bool dp = score_record(record, &query, qmats, NULL, 0);
+		w->kinds[i] =
+			record->score ? KIND_MATCH :
+			!is_candidate(record) ? KIND_OTHER :
+			dp ? KIND_CANDIDATE :
+			KIND_SKIPPED;
+	}
+}
+
+static void
+count_blocks(void *arg, uint32_t from, uint32_t to)
+{
+	struct score_work *w = arg;
+
+	for (uint32_t block = from; block < to; ++block) {
+		uint32_t counts[KIND_NB] = { 0 };
+		uint32_t end = (block + 1) * SCORE_BLOCK_SIZE;
+		if (w->n < end)
+			end = w->n;
+
+		for (uint32_t i = block * SCORE_BLOCK_SIZE; i < end; ++i)
+			++counts[w->kinds[i]];
+
+		memcpy(w->offsets[block], counts, sizeof counts);
+	}
+}
+
+static void
+scatter_blocks(void *arg, uint32_t from, uint32_t to)
+{
+	struct score_work *w = arg;
+
+	for (uint32_t block = from; block < to; ++block) {
+		uint32_t *offsets = w->offsets[block];
+		uint32_t end = (block + 1) * SCORE_BLOCK_SIZE;
+		if (w->n < end)
+			end = w->n;
+
+		for (uint32_t i = block * SCORE_BLOCK_SIZE; i < end; ++i)
+			w->scratch[offsets[w->kinds[i]]++] = w->records[i];
+	}
+}
+
+/* Score records[from..to) and move matching ones to records[nb_matches..],
+ * candidates to records[nb_candidates..]. records[nb_candidates..from) must
+ * not be candidates.
+ *
+ * Records are scored in chunks of similar size. Then each block counts its
+ * matches and candidates so they can be scattered to their final place in
+ * parallel, preserving their relative order. */
+static void
+score_range(uint32_t from, uint32_t to)
+{
+	static struct record **scratch;
+	static uint8_t *kinds;
+	static uint32_t scratch_size;
+
+	uint32_t n = to - from;
+	if (!n)
+		return;
+
+	/* Move range next to candidates. Only non-candidates are between. */
+	uint32_t gap = from - nb_candidates;
+	uint32_t nb_swaps = gap < n ? gap : n;
+	for (uint32_t i = 0; i < nb_swaps; ++i) {
+		struct record *t = records[nb_candidates + i];
+		records[nb_candidates + i] = records[to - nb_swaps + i];
+		records[to - nb_swaps + i] = t;
+	}
+	from = nb_candidates;
+
+	/* Previous candidates that are not matches have to be moved too. */
+	uint32_t nb_old = nb_candidates - nb_matches;
+	if (scratch_size < nb_old + n) {
+		scratch_size = nb_old + n;
+		scratch = realloc(scratch, scratch_size * sizeof *scratch);
+		kinds = realloc(kinds, scratch_size * sizeof *kinds);
+		if (!scratch || !kinds)
+			abort();
+	}
+
+	uint32_t nb_blocks = (n + SCORE_BLOCK_SIZE - 1) / SCORE_BLOCK_SIZE;
+	struct score_work w = {
+		.records = records + from,
+		.n = n,
+		.kinds = kinds,
+		.offsets = malloc(nb_blocks * sizeof *w.offsets),
+		.scratch = scratch,
+	};
+	if (!w.offsets)
+		abort();
+
+	parallel_for(n, w.records, score_chunk, &w);
+	parallel_for(nb_blocks, NULL, count_blocks, &w);
+
+	uint32_t next[KIND_NB] = { 0 };
+	for (uint32_t block = 0; block < nb_blocks; ++block)
+		for (uint32_t kind = 0; kind < KIND_NB; ++kind)
+			next[kind] += w.offsets[block][kind];
+	uint32_t nb_new_matches = next[KIND_MATCH];
+	uint32_t nb_new_candidates = next[KIND_CANDIDATE] + next[KIND_SKIPPED];
+
+	bool fuzzy = false;
+	for (uint32_t t = 0; t < query.nb_terms; ++t)
+		fuzzy |= TERM_FUZZY == query.terms[t].kind;
+	frame.nb_scanned += n;
+	frame.nb_rejected += next[KIND_OTHER];
+	if (fuzzy)
+		frame.nb_dp += n - next[KIND_OTHER] - next[KIND_SKIPPED];
+
+	/* Output: new matches, old candidates, new candidates, others. */
+	next[KIND_OTHER] = nb_new_matches + nb_old + nb_new_candidates;
+	next[KIND_SKIPPED] = nb_new_matches + nb_old + next[KIND_CANDIDATE];
+	next[KIND_CANDIDATE] = nb_new_matches + nb_old;
+	next[KIND_MATCH] = 0;
+	for (uint32_t block = 0; block < nb_blocks; ++block)
+		for (uint32_t kind = 0; kind < KIND_NB; ++kind) {
+			uint32_t count = w.offsets[block][kind];
+			w.offsets[block][kind] = next[kind];
+			next[kind] += count;
+		}
+
+	memcpy(scratch + nb_new_matches, records + nb_matches,
+			nb_old * sizeof *scratch);
+
+	parallel_for(nb_blocks, NULL, scatter_blocks, &w);
+
+	memcpy(records + nb_matches, scratch, (nb_old + n) * sizeof *records);
+	nb_matches += nb_new_matches;
+	nb_candidates += nb_new_matches + nb_new_candidates;
+
+	free(w.offsets);
+}
+
+/* Whether each byte of old matches a superset of what the corresponding byte
+ * of str matches, either at its start (anchored) or anywhere (contiguous) or
+ * as a subsequence. */
+static bool
+is_covered(char const *old, char const *str, bool anchored, bool contiguous)
+{
+	for (char const *start = str; *start; ++start) {
+		char const *o = old;
+		for (char const *s = start; *o && *s; ++s) {
+			if (*o == *s ||
+			    ('a' <= *o && *o <= 'z' && (*o ^ ' ') == *s))
+				++o;
+			else if (contiguous)
+				break;
+		}
+		if (!*o)
+			return true;
+		if (anchored)
+			break;
+	}
+	return !*old;
+}
+
+/* Whether every record matching term also matches old. */
+static bool
+is_implied(struct term const *old, struct term const *term)
+{
+	if (old->negate != term->negate)
+		return false;
+	/* !x rejects less than !y if y is implied by x. */
+	if (old->negate) {
+		struct term const *t = old;
+		old = term;
+		term = t;
+	}
+
+	switch (old->kind) {
+	case TERM_FUZZY:
+		return is_covered(old->str, term->str, false, false);
+
+	case TERM_EXACT:
+		return TERM_FUZZY != term->kind &&
+			is_covered(old->str, term->str, false, true);
+
+	case TERM_PREFIX:
+		return (TERM_PREFIX == term->kind || TERM_EQUAL == term->kind) &&
+			is_covered(old->str, term->str, true, true);
+
+	case TERM_SUFFIX:
+		return (TERM_SUFFIX == term->kind || TERM_EQUAL == term->kind) &&
+			old->size <= term->size &&
+			is_covered(old->str, term->str + term->size - old->size, true, true);
+
+	case TERM_EQUAL:
+		return TERM_EQUAL == term->kind &&
+			old->size == term->size &&
+			is_covered(old->str, term->str, true, true);
+	}
+
+	return false;
+}
+
+/* Whether every record matching query also matches old_query, i.e. each term
+ * of old_query is implied by a term of query. */
+static bool
+is_narrowing(char const *old_query, char const *query)
+{
+	struct query old, new;
+	parse_query(&old, old_query);
+	parse_query(&new, query);
+
+	for (uint32_t i = 0; i < old.nb_terms; ++i) {
+		uint32_t j = 0;
+		while (j < new.nb_terms && !is_implied(&old.terms[i], &new.terms[j]))
+			++j;
+		if (j == new.nb_terms)
+			return false;
+	}
+	return true;
+}
+
+static size_t
+snapshot_size(uint32_t nb_candidates)
+{
+	return offsetof(struct snapshot, candidates[nb_candidates]);
+}
+
+static void
+clear_snapshots(void)
+{
+	while (snapshots) {
+		struct snapshot *next = snapshots->next;
+		free(snapshots);
+		snapshots = next;
+	}
+	snapshots_size = 0;
+}
+
+/* Find snapshot of query and make it the most recently used. */
+static struct snapshot *
+find_snapshot(char const *query)
+{
+	for (struct snapshot **p = &snapshots; *p; p = &(*p)->next) {
+		struct snapshot *snapshot = *p;
+		if (strcmp(snapshot->query, query))
+			continue;
+
+		*p = snapshot->next;
+		snapshot->next = snapshots;
+		snapshots = snapshot;
+		return snapshot;
+	}
+	return NULL;
+}
+
+static void
+save_snapshot(void)
+{
+	if (find_snapshot(cur_query))
+		return;
+
+	size_t size = snapshot_size(nb_candidates);
+	if (opt_cache_size < size)
+		return;
+
+	/* Evict least recently used ones. */
+	while (opt_cache_size - size < snapshots_size) {
+		struct snapshot **p = &snapshots;
+		while ((*p)->next)
+			p = &(*p)->next;
+		snapshots_size -= snapshot_size((*p)->nb_candidates);
+		free(*p);
+		*p = NULL;
+	}
+
+	struct snapshot *snapshot = malloc(size);
+	if (!snapshot)
+		abort();
+
+	memcpy(snapshot->query, cur_query, sizeof snapshot->query);
+	snapshot->nb_matches = nb_matches;
+	snapshot->nb_candidates = nb_candidates;
+	snapshot->nb_sorted = nb_sorted;
+	for (uint32_t i = 0; i < nb_candidates; ++i) {
+		struct record *record = records[i];
+		snapshot->candidates[i].record = record;
+		snapshot->candidates[i].score = record->score;
+		snapshot->candidates[i].trail = record->trail;
+	}
+
+	snapshot->next = snapshots;
+	snapshots = snapshot;
+	snapshots_size += size;
+}
+
+static bool
+restore_snapshot(void)
+{
+	struct snapshot const *snapshot = find_snapshot(opt_query);
+	if (!snapshot)
+		return false;
+
+	/* Turn every record into a non-candidate, except snapshotted ones. */
+	for (uint32_t i = 0; i < nb_candidates; ++i) {
+		struct record *record = records[i];
+		record->score = 0;
+		record->trail = 0;
+	}
+	/* Scores of the previous query if scoring was abandoned. */
+	for (uint32_t i = job_from; i < job_to; ++i) {
+		struct record *record = records[i];
+		record->score = 0;
+		record->trail = 0;
+	}
+	for (uint32_t i = 0; i < snapshot->nb_candidates; ++i) {
+		struct record *record = snapshot->candidates[i].record;
+		record->score = snapshot->candidates[i].score;
+		record->trail = snapshot->candidates[i].trail;
+	}
+
+	/* Move non-candidates to the end then fill the gap in the original
+	 * order. */
+	for (uint32_t i = nb_records, j = nb_records; 0 < i--;)
+		if (!is_candidate(records[i]))
+			records[--j] = records[i];
+	for (uint32_t i = 0; i < snapshot->nb_candidates; ++i)
+		records[i] = snapshot->candidates[i].record;
+
+	nb_matches = snapshot->nb_matches;
+	nb_candidates = snapshot->nb_candidates;
+	nb_sorted = snapshot->nb_sorted;
+	return true;
+}
+
+/* Set masks of bytes for each term of query. */
+static void
+build_qmats(struct query const *query, uint64_t (*qmats)[UINT8_MAX + 1][MASK_WORDS])
+{
+	memset(qmats, 0, query->nb_terms * sizeof *qmats);
+	for (uint32_t t = 0; t < query->nb_terms; ++t) {
+		char const *str = query->terms[t].str;
+		for (uint32_t m = 0; str[m]; ++m) {
+			uint8_t c = str[m];
+			uint64_t bit = (uint64_t)1 << (m % MASK_BITS);
+			qmats[t][c][m / MASK_BITS] |= bit;
+			if ('a' <= c && c <= 'z')
+				qmats[t][c - 'a' + 'A'][m / MASK_BITS] |= bit;
+		}
+	}
+}
+
+/* Parse cur_query and set its masks. */
+static void
+load_query(void)
+{
+	parse_query(&query, cur_query);
+	qmats = realloc(qmats, (query.nb_terms + !query.nb_terms) * sizeof *qmats);
+	if (!qmats)
+		abort();
+	build_qmats(&query, qmats);
+}
+
+static bool
+is_scored(void)
+{
+	return job_from == job_to && nb_scored == nb_records;
+}
+
+static bool
+key_pending(void)
+{
+	struct pollfd fd = { .fd = fileno(tty), .events = POLLIN };
+	return 0 < poll(&fd, 1, 0);
+}
+
+/* Prepare scoring records for opt_query. Work left for previous query is
+ * abandoned. */
+static void
+start_scoring(void)
+{
+	bool same_query = !strcmp(opt_query, cur_query);
+	if (!records_changed && same_query)
+		return;
+
+	double start_msec = get_msec();
+	bool narrowing = is_narrowing(cur_query, opt_query);
+
+	/* Snapshots know nothing about new records. */
+	if (records_changed || nb_scored != nb_records)
+		clear_snapshots();
+	else if (job_from == job_to)
+		save_snapshot();
+
+	memcpy(cur_query, opt_query, sizeof cur_query);
+	load_query();
+
+	/* Match set of the DP is not monotonic in query (e.g. "/abc" matches
+	 * "abc" but not "bc") so only previous candidates can be reused. */
+	if (!records_changed && restore_snapshot()) {
+		job_from = nb_candidates;
+		job_to = nb_candidates;
+	} else if (records_changed || !narrowing) {
+		job_from = 0;
+		job_to = nb_records;
+		nb_scored = nb_records;
+		nb_matches = 0;
+		nb_candidates = 0;
+		nb_sorted = 0;
+	} else {
+		/* Records not yet scored for the previous query may still be
+		 * candidates, so move them next to its candidates. */
+		uint32_t n = job_to - job_from;
+		uint32_t gap = job_from - nb_candidates;
+		uint32_t nb_swaps = gap < n ? gap : n;
+		for (uint32_t i = 0; i < nb_swaps; ++i) {
+			struct record *t = records[nb_candidates + i];
+			records[nb_candidates + i] = records[job_to - nb_swaps + i];
+			records[job_to - nb_swaps + i] = t;
+		}
+		job_from = 0;
+		job_to = nb_candidates + n;
+		nb_matches = 0;
+		nb_candidates = 0;
+		nb_sorted = 0;
+	}
+
+	records_changed = false;
+
+	frame.score_msec += get_msec() - start_msec;
+}
+
+/* Score records until all done, or if interruptible, until time for a new
+ * frame or a key is pressed. Return whether all records are scored. */
+static bool
+score_some(bool interruptible)
+{
+	double start_msec = get_msec();
+	uint32_t slice = SCORE_BLOCK_SIZE;
+
+	for (;;) {
+		if (job_from == job_to) {
+			if (nb_scored == nb_records)
+				break;
+			/* Only newly arrived records. */
+			clear_snapshots();
+			job_from = nb_scored;
+			job_to = nb_records;
+			nb_scored = nb_records;
+		}
+
+		double slice_msec = get_msec();
+		uint32_t to = job_to - job_from <= slice ? job_to : job_from + slice;
+		score_range(job_from, to);
+		job_from = to;
+		nb_sorted = 0;
+
+		double msec = get_msec();
+		if (msec - slice_msec < SLICE_MSEC && slice <= UINT32_MAX / 2)
+			slice *= 2;
+		if (interruptible &&
+		    (REDRAW_MSEC <= msec - start_msec || key_pending()))
+			break;
+	}
+
+	frame.score_msec += get_msec() - start_msec;
+	return is_scored();
+}
+
+static void
+score_all(void)
+{
+	start_scoring();
+	score_some(false);
+}
+
+/* Narrow records to matches of current query, remembering how they were
+ * scored and ordered. Only these records are touched by later queries so
+ * others keep their state. */
+static void
+push_level(void)
+{
+	score_all();
+
+	struct level *level = malloc(offsetof(struct level, matches[nb_matches]));
+	if (!level)
+		abort();
+
+	memcpy(level->query, cur_query, sizeof level->query);
+	level->nb_records = nb_records;
+	level->nb_matches = nb_matches;
+	level->nb_candidates = nb_candidates;
+	level->nb_sorted = nb_sorted;
+	for (uint32_t i = 0; i < nb_matches; ++i) {
+		struct record *record = records[i];
+		level->matches[i].record = record;
+		level->matches[i].score = record->score;
+		level->matches[i].trail = record->trail;
+	}
+
+	level->next = levels;
+	levels = level;
+
+	nb_records = nb_matches;
+	records_changed = true;
+}
+
+/* Go back to the filter below the innermost one as it was left. */
+static bool
+pop_level(void)
+{
+	struct level *level = levels;
+	if (!level)
+		return false;
+	levels = level->next;
+
+	for (uint32_t i = 0; i < level->nb_matches; ++i) {
+		struct record *record = level->matches[i].record;
+		record->score = level->matches[i].score;
+		record->trail = level->matches[i].trail;
+		records[i] = record;
+	}
+
+	/* Unfiltered view includes records arrived since. */
+	nb_records = levels ? level->nb_records : nb_total_records;
+	nb_scored = level->nb_records;
+	nb_matches = level->nb_matches;
+	nb_candidates = level->nb_candidates;
+	nb_sorted = level->nb_sorted;
+	job_from = nb_candidates;
+	job_to = nb_candidates;
+
+	memcpy(cur_query, level->query, sizeof cur_query);
+	memcpy(opt_query, level->query, sizeof opt_query);
+	load_query();
+
+	/* They know only records of the inner filter. */
+	clear_snapshots();
+	records_changed = false;
+	/* Redraw even if query is the same. */
+	nb_screen_rows = 0;
+
+	free(level);
+	return true;
+}
+
+static void
+clear_levels(void)
+{
+	while (levels) {
+		struct level *next = levels->next;
+		free(levels);
+		levels = next;
+	}
+}
+
+/* Keys of sort_records() must give the same order. */
+static int
+compare_records(void const *px, void const *py)
+{
+	struct record const *x = *(struct record **)px;
+	struct record const *y = *(struct record **)py;
+	int cmp;
+
+	cmp = COMPARE(x->score, y->score);
+	if (cmp)
+		return -cmp;
+
+	cmp = COMPARE(x->trail, y->trail);
+	if (cmp)
+		return cmp;
+
+	cmp = COMPARE(x->size, y->size);
+	if (UINT32_MAX == x->score)
 		cmp = 0;
 	if (cmp)
 		return cmp;
 
-	return COMPARE(x->index, y->index);
+	return COMPARE(x->index, y->index);
+}
+
+static void
+sift_down(uint32_t i, uint32_t n)
+{
+	for (uint32_t child; (child = 2 * i + 1) < n; i = child) {
+		if (child + 1 < n &&
+		    compare_records(&records[child], &records[child + 1]) < 0)
+			++child;
+		if (compare_records(&records[i], &records[child]) >= 0)
+			break;
+		struct record *t = records[i];
+		records[i] = records[child];
+		records[child] = t;
+	}
+}
+
+/* What sort_records() shares with pool threads. Keys are packed so that
+ * comparing them as numbers gives the order of compare_records(). */
+struct sort_work {
+	uint32_t n;
+	/* ~score, trail. */
+	uint64_t *his;
+	/* size unless score is UINT32_MAX, index. */
+	uint64_t *los;
+	/* Position in records. */
+	uint32_t *ids;
+	/* Keys are moved here by a pass. */
+	uint64_t *next_his;
+	uint64_t *next_los;
+	uint32_t *next_ids;
+	uint64_t first_hi;
+	uint64_t first_lo;
+	/* Bits that differ from the first key, per segment. */
+	uint64_t (*diffs)[2];
+	/* [segment][digit]=Count, then output offset. */
+	uint32_t (*counts)[UINT8_MAX + 1];
+	/* Digit of the pass. */
+	bool high;
+	unsigned shift;
+	struct record **sorted;
+};
+
+static uint64_t
+get_key_hi(struct record const *record)
+{
+	return (uint64_t)~record->score << 32 | record->trail;
+}
+
+static uint64_t
+get_key_lo(struct record const *record)
+{
+	uint32_t size = UINT32_MAX == record->score ? 0 : record->size;
+	return (uint64_t)size << 32 | (uint32_t)record->index;
+}
+
+static void
+pack_keys(void *arg, uint32_t from, uint32_t to)
+{
+	struct sort_work *w = arg;
+
+	for (uint32_t segment = from; segment < to; ++segment) {
+		uint64_t diff_hi = 0, diff_lo = 0;
+		uint32_t end = (segment + 1) * RADIX_SEGMENT_SIZE;
+		if (w->n < end)
+			end = w->n;
+
+		for (uint32_t i = segment * RADIX_SEGMENT_SIZE; i < end; ++i) {
+			w->his[i] = get_key_hi(records[i]);
+			w->los[i] = get_key_lo(records[i]);
+			w->ids[i] = i;
+			diff_hi |= w->his[i] ^ w->first_hi;
+			diff_lo |= w->los[i] ^ w->first_lo;
+		}
+
+		w->diffs[segment][0] = diff_hi;
+		w->diffs[segment][1] = diff_lo;
+	}
+}
+
+static uint8_t
+get_digit(struct sort_work const *w, uint32_t i)
+{
+	return (w->high ? w->his[i] : w->los[i]) >> w->shift;
+}
+
+static void
+count_digits(void *arg, uint32_t from, uint32_t to)
+{
+	struct sort_work *w = arg;
+
+	for (uint32_t segment = from; segment < to; ++segment) {
+		uint32_t *counts = w->counts[segment];
+		uint32_t end = (segment + 1) * RADIX_SEGMENT_SIZE;
+		if (w->n < end)
+			end = w->n;
+
+		memset(counts, 0, sizeof *w->counts);
+		for (uint32_t i = segment * RADIX_SEGMENT_SIZE; i < end; ++i)
+			++counts[get_digit(w, i)];
+	}
+}
+
+static void
+move_keys(void *arg, uint32_t from, uint32_t to)
+{
+	struct sort_work *w = arg;
+
+	for (uint32_t segment = from; segment < to; ++segment) {
+		uint32_t *offsets = w->counts[segment];
+		uint32_t end = (segment + 1) * RADIX_SEGMENT_SIZE;
+		if (w->n < end)
+			end = w->n;
+
+		for (uint32_t i = segment * RADIX_SEGMENT_SIZE; i < end; ++i) {
+			uint32_t j = offsets[get_digit(w, i)]++;
+			w->next_his[j] = w->his[i];
+			w->next_los[j] = w->los[i];
+			w->next_ids[j] = w->ids[i];
+		}
+	}
+}
+
+static void
+gather_records(void *arg, uint32_t from, uint32_t to)
+{
+	struct sort_work *w = arg;
+
+	uint32_t end = to * RADIX_SEGMENT_SIZE;
+	if (w->n < end)
+		end = w->n;
+
+	for (uint32_t i = from * RADIX_SEGMENT_SIZE; i < end; ++i)
+		w->sorted[i] = records[w->ids[i]];
+}
+
+/* Sort records[0..n) by their packed keys using LSD radix sort. Every pass is
+ * stable: segments count their digits and move keys to their place in
+ * parallel. Bytes that are the same in every key are skipped. */
+static void
+sort_records(uint32_t n)
+{
+	/* Keys only hold the lower half of indices. */
+	if (n < RADIX_SORT_SIZE || UINT32_MAX < nb_streamed) {
+		qsort(records, n, sizeof *records, compare_records);
+		return;
+	}
+
+	uint32_t nb_segments = (n + RADIX_SEGMENT_SIZE - 1) / RADIX_SEGMENT_SIZE;
+	struct sort_work w = {
+		.n = n,
+		.first_hi = get_key_hi(records[0]),
+		.first_lo = get_key_lo(records[0]),
+		.his = malloc(n * sizeof *w.his),
+		.los = malloc(n * sizeof *w.los),
+		.ids = malloc(n * sizeof *w.ids),
+		.next_his = malloc(n * sizeof *w.next_his),
+		.next_los = malloc(n * sizeof *w.next_los),
+		.next_ids = malloc(n * sizeof *w.next_ids),
+		.diffs = malloc(nb_segments * sizeof *w.diffs),
+		.counts = malloc(nb_segments * sizeof *w.counts),
+	};
+	if (!w.his || !w.los || !w.ids ||
+	    !w.next_his || !w.next_los || !w.next_ids ||
+	    !w.diffs || !w.counts)
+		abort();
+
+	parallel_for(nb_segments, NULL, pack_keys, &w);
+
+	uint64_t diff_hi = 0, diff_lo = 0;
+	for (uint32_t segment = 0; segment < nb_segments; ++segment) {
+		diff_hi |= w.diffs[segment][0];
+		diff_lo |= w.diffs[segment][1];
+	}
+
+	for (unsigned digit = 0; digit < 2 * sizeof(uint64_t); ++digit) {
+		w.high = sizeof(uint64_t) <= digit;
+		w.shift = digit % sizeof(uint64_t) * CHAR_BIT;
+		if (!(uint8_t)((w.high ? diff_hi : diff_lo) >> w.shift))
+			continue;
+
+		parallel_for(nb_segments, NULL, count_digits, &w);
+
+		uint32_t offset = 0;
+		for (unsigned c = 0; c <= UINT8_MAX; ++c)
+			for (uint32_t segment = 0; segment < nb_segments; ++segment) {
+				uint32_t count = w.counts[segment][c];
+				w.counts[segment][c] = offset;
+				offset += count;
+			}
+
+		parallel_for(nb_segments, NULL, move_keys, &w);
+
+		uint64_t *t = w.his;
+		w.his = w.next_his;
+		w.next_his = t;
+		t = w.los;
+		w.los = w.next_los;
+		w.next_los = t;
+		uint32_t *ids = w.ids;
+		w.ids = w.next_ids;
+		w.next_ids = ids;
+	}
+
+	w.sorted = malloc(n * sizeof *w.sorted);
+	if (!w.sorted)
+		abort();
+	parallel_for(nb_segments, NULL, gather_records, &w);
+	memcpy(records, w.sorted, n * sizeof *records);
+
+	free(w.sorted);
+	free(w.counts);
+	free(w.diffs);
+	free(w.next_ids);
+	free(w.next_los);
+	free(w.next_his);
+	free(w.ids);
+	free(w.los);
+	free(w.his);
 }
 
+/* Make sure at least the first k matches are in order. */
 static void
-sort_all(void)
+sort_all(uint32_t k)
 {
 	if (!opt_sort)
 		return;
-	qsort(records, nb_matches, sizeof *records, compare_records);
+
+	if (nb_matches < k)
+		k = nb_matches;
+	if (k <= nb_sorted)
+		return;
+
+	double start_msec = get_msec();
+
+	/* Select best k using a max-heap of them. */
+	if (k < nb_matches / 2) {
+		for (uint32_t i = k / 2; 0 < i--;)
+			sift_down(i, k);
+
+		for (uint32_t i = k; i < nb_matches; ++i) {
+			if (compare_records(&records[i], &records[0]) >= 0)
+				continue;
+			struct record *t = records[0];
+			records[0] = records[i];
+			records[i] = t;
+			sift_down(0, k);
+		}
+	} else {
+		k = nb_matches;
+	}
+
+	sort_records(k);
+	nb_sorted = k;
+
+	frame.sort_msec += get_msec() - start_msec;
 }
 
 static char const *
@@ -560,74 +2403,323 @@ gen_word(uint32_t i, char a, char z)
 	return p;
 }
 
+/* Records read but not yet handed over to the main thread. */
+static struct record *batch[READ_BATCH];
+static uint32_t nb_batch;
+
 static void
-read_records(FILE *stream)
+flush_records(void)
 {
-	char *line = NULL;
-	size_t linesz = 0;
-	for (ssize_t linelen;
-	     0 < (linelen = getdelim(&line, &linesz, opt_delim, stream));)
-	{
-		char pre[32];
-		int presz = 0;
-		if (opt_prefix_alpha) {
-			char const *word = gen_word(nb_total_records, 'A', 'Z');
-			presz = sprintf(pre, "%s:\t", word);
+	if (!nb_batch)
+		return;
+
+	pthread_mutex_lock(&pending_lock);
+	uint32_t nb_next = nb_pending + nb_batch;
+	if (pending_size < nb_next) {
+		pending_size = 2 * nb_next;
+		pending = realloc(pending, pending_size * sizeof *pending);
+		if (!pending)
+			abort();
+	}
+	memcpy(pending + nb_pending, batch, nb_batch * sizeof *batch);
+	bool wakeup = !nb_pending;
+	nb_pending = nb_next;
+	pthread_mutex_unlock(&pending_lock);
+	nb_batch = 0;
+
+	if (wakeup)
+		(void)!write(reader_pipe[1], "", 1);
+}
+
+static void
+mark_chunk(void *arg, uint32_t from, uint32_t to)
+{
+	struct record **records = arg;
+
+	for (uint32_t i = from; i < to; ++i)
+		mark_ignored(records[i]);
+}
+
+/* Scan records[from..] that were read synchronously. */
+static void
+mark_records(uint32_t from)
+{
+	parallel_for(nb_total_records - from, records + from,
+			mark_chunk, records + from);
+}
+
+/* Hand marked record over to the main thread. */
+static void
+queue_record(struct record *record)
+{
+	batch[nb_batch++] = record;
+	if (READ_BATCH == nb_batch)
+		flush_records();
+}
+
+static void
+add_record(struct record *record, bool async)
+{
+	/* Otherwise marked by mark_records(). */
+	if (!async) {
+		append_record(record);
+		return;
+	}
+
+	mark_ignored(record);
+	queue_record(record);
+}
+
+/* Take records of mapped input from index if it belongs to input. */
+static bool
+load_index(struct index_header const *key, bool async)
+{
+	int fd = open(opt_index, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (!fstat(fd, &st) && sizeof *key <= (size_t)st.st_size)
+		map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (MAP_FAILED == map)
+		return false;
+
+	struct index_header const *header = map;
+	uint8_t *start = (uint8_t *)map + sizeof *header;
+	uint8_t *end = (uint8_t *)map + st.st_size;
+	bool ok = !memcmp(header, key, offsetof(struct index_header, nb_records));
+
+	/* Check everything before adding anything. */
+	uint8_t *p = start;
+	for (uint64_t i = 0; ok && i < header->nb_records; ++i) {
+		struct record const *record = (void *)p;
+		ok = offsetof(struct record, bytes) <= (size_t)(end - p) &&
+		     WIDE_SIZE != record->size &&
+		     record_size(record->size, true) <= (size_t)(end - p) &&
+		     record->size <= key->size &&
+		     (uintptr_t)record->str <= key->size - record->size;
+		p += ok ? record_size(record->size, true) : 0;
+	}
+	if (!ok) {
+		munmap(map, st.st_size);
+		return false;
+	}
+
+	index_map = map;
+	index_mapsz = st.st_size;
+
+	p = start;
+	for (uint64_t i = 0; i < header->nb_records; ++i) {
+		struct record *record = (void *)p;
+		p += record_size(record->size, true);
+		record->str = (uint8_t *)input_map + (uintptr_t)record->str;
+		record->starts = UINT32_MAX;
+		/* Already marked. */
+		if (async)
+			queue_record(record);
+		else
+			append_record(record);
+	}
+
+	return true;
+}
+
+/* Index being written to a temporary file. */
+static char *index_tmp;
+static int index_fd = -1;
+static uint8_t *index_buf;
+static size_t index_used;
+static bool index_failed;
+/* Wide records are not indexed. */
+static bool index_wide;
+
+static void
+flush_index(void)
+{
+	for (uint8_t const *p = index_buf; !index_failed && index_used;) {
+		ssize_t rc = write(index_fd, p, index_used);
+		if (rc < 0 && EINTR == errno)
+			continue;
+		index_failed = rc <= 0;
+		if (0 < rc) {
+			p += rc;
+			index_used -= rc;
 		}
+	}
+	index_used = 0;
+}
 
-		linelen -= opt_delim == line[linelen - 1];
-		add_record(pre, presz, line, linelen);
+static void
+write_index(void const *buf, size_t size)
+{
+	while (CHUNK_SIZE - index_used < size) {
+		size_t n = CHUNK_SIZE - index_used;
+		memcpy(index_buf + index_used, buf, n);
+		index_used += n;
+		buf = (uint8_t const *)buf + n;
+		size -= n;
+		flush_index();
 	}
-	free(line);
+	memcpy(index_buf + index_used, buf, size);
+	index_used += size;
 }
 
-static uint32_t
-print_records(int nb_lines)
+static bool
+create_index(struct index_header const *key)
 {
-	if (nb_lines < 0)
-		return 0;
+	index_tmp = malloc(strlen(opt_index) + sizeof ".XXXXXX");
+	index_buf = malloc(CHUNK_SIZE);
+	if (!index_tmp || !index_buf)
+		abort();
+	sprintf(index_tmp, "%s.XXXXXX", opt_index);
 
-	uint32_t count = 0;
-	for (uint32_t i = 0; i < nb_matches && i < (uint32_t)nb_lines; ++i) {
-		fputs("\n\033[m", tty);
-		++count;
+	index_fd = mkstemp(index_tmp);
+	if (index_fd < 0) {
+		perror("Cannot create index");
+		free(index_tmp);
+		free(index_buf);
+		return false;
+	}
 
-		struct record *record = records[i];
-		uint32_t positions[4 * QUERY_SIZE + 1];
-		score_record(record, positions, sizeof positions / sizeof *positions);
+	index_used = 0;
+	index_failed = false;
+	index_wide = false;
+	write_index(key, sizeof *key);
+	return true;
+}
 
-#if 0
-		fprintf(tty, "(%5d,%5d) ", record->score, record->trail);
-#endif
+static void
+write_index_record(struct record const *record)
+{
+	static uint8_t const zeros[alignof(struct record)];
 
-		uint8_t const *str = record->bytes + BITS_SIZE(record->size);
-		uint32_t start = 0;
-		for (uint32_t k = 0;; ++k) {
-			uint32_t end = positions[k];
-			if (UINT32_MAX == end)
-				break;
+	index_wide |= WIDE_SIZE == record->size;
+	if (index_wide)
+		return;
 
-			fwrite(str + start, 1, end - start, tty);
+	struct record copy = *record;
+	copy.str = (uint8_t const *)(uintptr_t)(record->str - (uint8_t *)input_map);
 
-			while ((start = positions[k] + 1) == positions[k + 1])
-				++k;
+	size_t bitmap_size = BITS_SIZE(record->size);
+	write_index(&copy, offsetof(struct record, bytes));
+	write_index(record->bytes, bitmap_size);
+	write_index(zeros,
+			record_size(record->size, true) -
+			offsetof(struct record, bytes[bitmap_size]));
+}
+
+static void
+finish_index(struct index_header *key, uint64_t nb_records)
+{
+	flush_index();
+
+	key->nb_records = nb_records;
+	index_failed |= lseek(index_fd, 0, SEEK_SET) < 0;
+	write_index(key, sizeof *key);
+	flush_index();
+
+	index_failed |= close(index_fd) < 0;
+	if (index_wide) {
+		unlink(index_tmp);
+	} else if (index_failed || rename(index_tmp, opt_index)) {
+		perror("Cannot write index");
+		unlink(index_tmp);
+	}
+	index_fd = -1;
+	free(index_tmp);
+	free(index_buf);
+}
+
+/* Exiting while still reading in the background leaves index unfinished. */
+static void
+remove_index_tmp(void)
+{
+	if (0 <= index_fd)
+		unlink(index_tmp);
+}
+
+/* Let records point directly into input if it is a regular file. */
+static bool
+map_records(FILE *stream, bool async)
+{
+	int fd = fileno(stream);
+	struct stat st;
+	off_t offset;
+	if (opt_prefix_alpha ||
+	    fstat(fd, &st) < 0 ||
+	    !S_ISREG(st.st_mode) ||
+	    (offset = lseek(fd, 0, SEEK_CUR)) < 0)
+		return false;
+
+	if (st.st_size <= offset)
+		return true;
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (MAP_FAILED == map)
+		return false;
+	input_map = map;
+	input_mapsz = st.st_size;
+
+	bool index = false;
+	struct index_header key = {
+		.magic = INDEX_MAGIC,
+		.version = INDEX_VERSION,
+		.record_size = sizeof(struct record),
+		.delim = (uint8_t)opt_delim,
+		.dev = st.st_dev,
+		.ino = st.st_ino,
+		.size = st.st_size,
+		.mtime_sec = st.st_mtim.tv_sec,
+		.mtime_nsec = st.st_mtim.tv_nsec,
+		.offset = offset,
+	};
+	if (opt_index) {
+		if (load_index(&key, async))
+			return true;
+		index = create_index(&key);
+	}
 
-			fputs(opt_hi_start, tty);
-			fwrite(str + end, 1, start - end, tty);
-			fputs(opt_hi_end, tty);
+	uint64_t nb_read = 0;
+	uint32_t first = nb_total_records;
+	for (uint8_t const *p = (uint8_t *)map + offset,
+	     *end = (uint8_t *)map + st.st_size;
+	     p < end;)
+	{
+		uint8_t const *delim = memchr(p, opt_delim, end - p);
+		size_t sz = (delim ? delim : end) - p;
+		struct record *record = new_mapped_record(p, sz);
+		if (index && async) {
+			/* Main thread may score it once queued. */
+			mark_ignored(record);
+			write_index_record(record);
+			queue_record(record);
+		} else {
+			add_record(record, async);
 		}
+		++nb_read;
+		p += sz + 1;
+	}
 
-		fwrite(str + start, 1, record->size - start, tty);
+	if (!async) {
+		mark_records(first);
+		if (index)
+			for (uint32_t i = first; i < nb_total_records; ++i)
+				write_index_record(records[i]);
 	}
 
-	return count;
+	if (index)
+		finish_index(&key, nb_read);
+
+	return true;
 }
 
 static void
 print_record(struct record const *record, FILE *stream)
 {
-	uint8_t const *str = record->bytes + BITS_SIZE(record->size);
-	uint32_t size = record->size;
+	uint8_t const *str = record->str;
+	size_t size = get_size(record);
 	/* Cut prefix. */
 	if (opt_prefix_alpha) {
 		uint8_t const *p = memchr(str, '\t', size);
@@ -639,23 +2731,346 @@ print_record(struct record const *record, FILE *stream)
 }
 
 static void
-emit_record(struct record const *record)
+emit_record(struct record const *record, bool index, FILE *stream)
+{
+	if (index) {
+		fprintf(stream, "%"PRIu64, record->index);
+	} else {
+		print_record(record, stream);
+	}
+	fputc(opt_delim, stream);
+}
+
+/* Score records read since the last call, then print matches as they are or
+ * keep only the best opt_lines of them. Others are freed so memory does not
+ * grow with input. */
+static void
+stream_records(void)
 {
-	if (opt_print_indices) {
-		printf("%"PRIu32, record->index);
+	uint32_t nb_kept = nb_matches;
+	for (uint32_t i = nb_kept; i < nb_total_records; ++i)
+		records[i]->index = nb_streamed++;
+	mark_records(nb_kept);
+
+	nb_records = nb_total_records;
+	score_range(nb_kept, nb_total_records);
+
+	if (opt_sort && 0 < opt_lines) {
+		nb_sorted = 0;
+		sort_all(opt_lines);
+		if ((uint32_t)opt_lines < nb_matches)
+			nb_matches = opt_lines;
 	} else {
-		print_record(record, stdout);
+		for (uint32_t i = 0; i < nb_matches; ++i) {
+			emit_record(records[i], opt_print_indices, stdout);
+			if (++nb_emitted == (uint64_t)opt_lines)
+				break;
+		}
+		fflush(stdout);
+		if (0 < opt_lines && nb_emitted == (uint64_t)opt_lines)
+			exit(EXIT_SUCCESS);
+		nb_matches = 0;
+	}
+
+	keep_records(nb_matches);
+}
+
+static void
+read_records(FILE *stream, bool async)
+{
+	/* Streamed records are not kept so they are not worth mapping. */
+	if (opt_stream || !map_records(stream, async)) {
+		int fd = fileno(stream);
+		uint32_t first = nb_total_records;
+		uint32_t nb_read = nb_total_records;
+
+		size_t bufsz = CHUNK_SIZE;
+		char *buf = malloc(bufsz);
+		if (!buf)
+			abort();
+
+		/* Split whole blocks; keep incomplete last record for the next.
+		 * Its first scanned bytes are known to have no delimiter. */
+		for (size_t len = 0, scanned = 0;;) {
+			if (len == bufsz) {
+				bufsz *= 2;
+				buf = realloc(buf, bufsz);
+				if (!buf)
+					abort();
+			}
+
+			ssize_t rc = read(fd, buf + len, bufsz - len);
+			if (rc < 0 && EINTR == errno)
+				continue;
+			bool eof = rc <= 0;
+			if (!eof)
+				len += rc;
+
+			char const *p = buf, *end = buf + len;
+			while (p < end) {
+				char const *delim = memchr(p + scanned, opt_delim,
+						end - p - scanned);
+				scanned = 0;
+				if (!delim && !eof) {
+					scanned = end - p;
+					break;
+				}
+
+				char pre[32];
+				int presz = 0;
+				if (opt_prefix_alpha) {
+					char const *word = gen_word(nb_read, 'A', 'Z');
+					presz = sprintf(pre, "%s:\t", word);
+				}
+				++nb_read;
+
+				size_t sz = (delim ? delim : end) - p;
+				add_record(new_record(pre, presz, p, sz), async);
+				p += sz + 1;
+			}
+			if (eof)
+				break;
+			len = end - p;
+			if (p != buf)
+				memmove(buf, p, len);
+			if (async)
+				flush_records();
+			else if (opt_stream)
+				stream_records();
+		}
+		free(buf);
+
+		if (opt_stream)
+			stream_records();
+		else if (!async)
+			mark_records(first);
+	}
+
+	if (async)
+		flush_records();
+}
+
+static void *
+read_records_async(void *arg)
+{
+	FILE *stream = arg;
+	read_records(stream, true);
+	fclose(stream);
+
+	pthread_mutex_lock(&pending_lock);
+	reader_done = true;
+	pthread_mutex_unlock(&pending_lock);
+	(void)!write(reader_pipe[1], "", 1);
+
+	return NULL;
+}
+
+/* Read records in the background. They show up only after wait_key(). */
+static void
+start_reading(FILE *stream)
+{
+	reading = true;
+	reader_done = false;
+	if (pipe(reader_pipe) ||
+	    fcntl(reader_pipe[0], F_SETFL, O_NONBLOCK) < 0 ||
+	    fcntl(reader_pipe[1], F_SETFL, O_NONBLOCK) < 0 ||
+	    pthread_create(&reader_thread, NULL, read_records_async, stream))
+		abort();
+}
+
+/* Take over records from reader thread. */
+static bool
+take_pending(void)
+{
+	pthread_mutex_lock(&pending_lock);
+	struct record **batch = pending;
+	uint32_t nb_batch = nb_pending;
+	bool done = reader_done;
+	pending = NULL;
+	nb_pending = 0;
+	pending_size = 0;
+	pthread_mutex_unlock(&pending_lock);
+
+	for (uint32_t i = 0; i < nb_batch; ++i)
+		append_record(batch[i]);
+	free(batch);
+
+	return done;
+}
+
+static void
+finish_reading(void)
+{
+	if (!reading)
+		return;
+
+	pthread_join(reader_thread, NULL);
+	take_pending();
+
+	close(reader_pipe[0]);
+	close(reader_pipe[1]);
+	reading = false;
+}
+
+/* Wait until a key can be read. Return false if new records arrived
+ * meanwhile. */
+static bool
+wait_key(void)
+{
+	struct pollfd fds[] = {
+		{ .fd = fileno(tty), .events = POLLIN },
+		{ .fd = reader_pipe[0], .events = POLLIN },
+	};
+
+	/* Wait here so time spent in readline can be measured. Do not wait
+	 * if there is scoring left. */
+	bool scored = is_scored();
+	poll(fds, reading ? 2 : 1, scored ? -1 : 0);
+	if (reading && fds[1].revents) {
+		char buf[64];
+		(void)!read(reader_pipe[0], buf, sizeof buf);
+		/* Let records pile up a bit unless user wants something. */
+		if (!fds[0].revents && scored)
+			poll(fds, 1, REDRAW_MSEC);
+		if (take_pending())
+			finish_reading();
+	}
+
+	return fds[0].revents;
+}
+
+static void
+write_line(void const *buf, size_t size)
+{
+	if (line_capacity - line_size < size) {
+		line_capacity = 2 * (line_size + size);
+		line = realloc(line, line_capacity);
+		if (!line)
+			abort();
+	}
+	memcpy(line + line_size, buf, size);
+	line_size += size;
+}
+
+__attribute__((format(printf, 1, 2)))
+static void
+printf_line(char const *format, ...)
+{
+	char buf[256];
+	va_list ap;
+
+	va_start(ap, format);
+	int n = vsnprintf(buf, sizeof buf, format, ap);
+	va_end(ap);
+	if (0 < n)
+		write_line(buf, (size_t)n < sizeof buf ? (size_t)n : sizeof buf - 1);
+}
+
+/* Move to next row and show line there unless it is already there. */
+static void
+draw_line(uint32_t i, struct record const *record)
+{
+	fputc('\n', tty);
+
+	if (screen_capacity <= i) {
+		uint32_t nb_next = 2 * (i + 1);
+		screen = realloc(screen, nb_next * sizeof *screen);
+		if (!screen)
+			abort();
+		memset(screen + screen_capacity, 0,
+				(nb_next - screen_capacity) * sizeof *screen);
+		screen_capacity = nb_next;
+	}
+
+	struct row *row = &screen[i];
+	row->record = record;
+	if (i < nb_screen_rows &&
+	    row->size == line_size &&
+	    !memcmp(row->bytes, line, line_size))
+		return;
+
+	fputs("\033[m\033[K", tty);
+	fwrite(line, 1, line_size, tty);
+
+	row->bytes = realloc(row->bytes, line_size + 1);
+	if (!row->bytes)
+		abort();
+	memcpy(row->bytes, line, line_size);
+	row->size = line_size;
+}
+
+/* Draw records to rows [1..nb_lines]. Rows of the same records highlighted
+ * for the same query are left as is. */
+static uint32_t
+print_records(int nb_lines)
+{
+	if (nb_lines < 0)
+		return 0;
+
+	double start_msec = get_msec();
+	bool same_query = !strcmp(screen_query, cur_query);
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < nb_matches && i < (uint32_t)nb_lines; ++i) {
+		++count;
+
+		struct record *record = records[i];
+		if (same_query && 1 + i < nb_screen_rows &&
+		    record == screen[1 + i].record)
+		{
+			fputc('\n', tty);
+			continue;
+		}
+
+		/* Positions of wide records do not fit, so they are not
+		 * highlighted. */
+		uint32_t positions[4 * QUERY_SIZE + 1] = { UINT32_MAX };
+		score_record(record, &query, qmats,
+				positions,
+				WIDE_SIZE != record->size
+					? sizeof positions / sizeof *positions
+					: 0);
+
+		line_size = 0;
+#if 0
+		printf_line("(%5d,%5d) ", record->score, record->trail);
+#endif
+
+		uint8_t const *str = record->str;
+		uint32_t start = 0;
+		for (uint32_t k = 0;; ++k) {
+			uint32_t end = positions[k];
+			if (UINT32_MAX == end)
+				break;
+
+			write_line(str + start, end - start);
+
+			while ((start = positions[k] + 1) == positions[k + 1])
+				++k;
+
+			write_line(opt_hi_start, strlen(opt_hi_start));
+			write_line(str + end, start - end);
+			write_line(opt_hi_end, strlen(opt_hi_end));
+		}
+
+		write_line(str + start, get_size(record) - start);
+		draw_line(1 + i, record);
 	}
-	fputc(opt_delim, stdout);
+	memcpy(screen_query, cur_query, sizeof screen_query);
+
+	frame.print_msec += get_msec() - start_msec;
+	return count;
 }
 
 static bool
 emit_one(void)
 {
+	score_all();
 	if (!nb_matches)
 		return false;
 
-	emit_record(records[0]);
+	sort_all(1);
+
+	emit_record(records[0], opt_print_indices, stdout);
 	fflush(stdout);
 
 	return true;
@@ -664,11 +3079,14 @@ emit_one(void)
 static bool
 emit_all(void)
 {
+	score_all();
 	if (!nb_matches)
 		return false;
 
+	sort_all(nb_matches);
+
 	for (uint32_t i = 0; i < nb_matches; ++i)
-		emit_record(records[i]);
+		emit_record(records[i], opt_print_indices, stdout);
 	fflush(stdout);
 
 	return true;
@@ -700,6 +3118,10 @@ edit_records(uint32_t n)
 	int fd = mkstemp(pathname);
 	if (fd < 0)
 		return;
+	finish_reading();
+	score_all();
+	sort_all(nb_matches);
+
 	FILE *f = fdopen(fd, "w");
 	if (!f)
 		abort();
@@ -741,20 +3163,30 @@ edit_records(uint32_t n)
 	if (!input)
 		return;
 
+	clear_levels();
 	clear_records();
-	read_records(input);
+	/* Index belongs to the original input. */
+	opt_index = NULL;
+	read_records(input, false);
 	nb_matches = nb_total_records;
 	nb_records = nb_total_records;
-	records_changed = true;
 
 	fclose(input);
 }
 
+/* Keys typed ahead may have changed line since last frame. */
+static void
+update_query(char const *line)
+{
+	snprintf(opt_query, sizeof opt_query, "%s", line);
+}
+
 static void
 fizzy_rl_handle_line(char *line)
 {
 	if (!line)
 		exit(EXIT_FAILURE);
+	update_query(line);
 	accept_one();
 }
 
@@ -762,6 +3194,7 @@ static int
 fizzy_rl_accept_all(int count, int c)
 {
 	(void)count, (void)c;
+	update_query(rl_line_buffer);
 	accept_all();
 	return 1;
 }
@@ -770,6 +3203,7 @@ static int
 fizzy_rl_accept_one(int count, int c)
 {
 	(void)count, (void)c;
+	update_query(rl_line_buffer);
 	accept_one();
 	return 1;
 }
@@ -786,6 +3220,7 @@ static int
 fizzy_rl_edit(int count, int c)
 {
 	(void)count, (void)c;
+	update_query(rl_line_buffer);
 	edit_records(nb_records);
 	/* Force redraw. */
 	records_changed = true;
@@ -796,6 +3231,7 @@ static int
 fizzy_rl_emit_all(int count, int c)
 {
 	(void)count, (void)c;
+	update_query(rl_line_buffer);
 	emit_all();
 	return 1;
 }
@@ -804,6 +3240,7 @@ static int
 fizzy_rl_emit_one(int count, int c)
 {
 	(void)count, (void)c;
+	update_query(rl_line_buffer);
 	emit_one();
 	return 1;
 }
@@ -819,22 +3256,107 @@ static int
 fizzy_rl_filter_matched(int count, int c)
 {
 	(void)count, (void)c;
-	nb_records = nb_matches;
-	records_changed = true;
+	update_query(rl_line_buffer);
+	push_level();
 	rl_replace_line("", true);
 	return 1;
 }
 
+static int
+fizzy_rl_filter_pop(int count, int c)
+{
+	(void)count, (void)c;
+	if (!pop_level())
+		return 0;
+	rl_replace_line(opt_query, true);
+	rl_point = rl_end;
+	return 1;
+}
+
 static int
 fizzy_rl_filter_reset(int count, int c)
 {
 	(void)count, (void)c;
-	nb_records = nb_total_records;
-	records_changed = true;
+	if (levels) {
+		/* Unfiltered records are still scored for the outermost
+		 * query. */
+		while (levels->next) {
+			struct level *next = levels->next;
+			free(levels);
+			levels = next;
+		}
+		pop_level();
+	} else {
+		nb_records = nb_total_records;
+		records_changed = true;
+	}
 	rl_replace_line("", true);
 	return 1;
 }
 
+static void
+end_frame(void)
+{
+	if (0 <= opt_stats_fd) {
+		if (!(nb_frames & (nb_frames - 1))) {
+			uint32_t nb_next = 2 * nb_frames + !nb_frames;
+			frames = realloc(frames, nb_next * sizeof *frames);
+			if (!frames)
+				abort();
+		}
+		frames[nb_frames++] = frame;
+	}
+
+	last_frame = frame;
+	memset(&frame, 0, sizeof frame);
+}
+
+static void
+print_stats(void)
+{
+	printf_line("score %.1f sort %.1f print %.1f readline %.1f ms, "
+			"%"PRIu64" scanned %"PRIu64" rejected %"PRIu64" DP ",
+			frame.score_msec, frame.sort_msec,
+			last_frame.print_msec, last_frame.readline_msec,
+			frame.nb_scanned, frame.nb_rejected, frame.nb_dp);
+}
+
+static void
+write_stats(void)
+{
+	/* Unfinished one too. */
+	end_frame();
+
+	FILE *stream = fdopen(opt_stats_fd, "w");
+	if (!stream) {
+		perror("Cannot open statistics file descriptor");
+		return;
+	}
+
+	fputs("{\"frames\":[", stream);
+	for (uint32_t i = 0; i < nb_frames; ++i) {
+		struct frame const *f = &frames[i];
+		fprintf(stream, "%s\n{"
+				"\"score_all_ms\":%.3f,"
+				"\"sort_all_ms\":%.3f,"
+				"\"print_records_ms\":%.3f,"
+				"\"readline_ms\":%.3f,"
+				"\"scanned\":%"PRIu64","
+				"\"rejected\":%"PRIu64","
+				"\"dp\":%"PRIu64"}",
+				0 < i ? "," : "",
+				f->score_msec,
+				f->sort_msec,
+				f->print_msec,
+				f->readline_msec,
+				f->nb_scanned,
+				f->nb_rejected,
+				f->nb_dp);
+	}
+	fputs("\n]}\n", stream);
+	fclose(stream);
+}
+
 static void
 handle_interrupt(int sig)
 {
@@ -848,10 +3370,579 @@ handle_interrupt(int sig)
 	exit(EXIT_FAILURE);
 }
 
+static void
+print_stage(char const *name, uint32_t nb_calls, double msec,
+		uint64_t nb_bytes, uint64_t nb_recs)
+{
+	printf("%-18s %6"PRIu32" calls %10.2f ms %9.3f ms/call",
+			name, nb_calls, msec, msec / nb_calls);
+	if (nb_bytes)
+		printf(" %9.1f MB/s", nb_bytes / msec / 1e3);
+	else
+		printf(" %9s     ", "-");
+	printf(" %8.2f Mrec/s\n", nb_recs / msec / 1e3);
+}
+
+/* Time processing stages as if query was typed byte by byte. */
+static int
+benchmark(FILE *input)
+{
+	enum {
+		NB_ROUNDS = 3,
+		NB_ROWS = 50,
+	};
+
+	char query[sizeof opt_query];
+	memcpy(query, opt_query, sizeof query);
+	size_t query_size = strlen(query);
+
+	tty = fopen("/dev/null", "w");
+	if (!tty) {
+		perror("Cannot open /dev/null");
+		return EXIT_FAILURE;
+	}
+
+	double start = get_msec();
+	read_records(input, false);
+	double msec = get_msec() - start;
+	nb_records = nb_total_records;
+	nb_matches = nb_total_records;
+
+	uint64_t size = 0;
+	for (uint32_t i = 0; i < nb_records; ++i)
+		size += get_size(records[i]) + 1 /* Delimiter. */;
+
+	printf("%"PRIu32" records, %"PRIu64" bytes, query \"%s\"\n",
+			nb_records, size, query);
+	print_stage("read_records", 1, msec, size, nb_records);
+
+	msec = 0;
+	for (size_t m = 0; m <= query_size; ++m) {
+		memcpy(opt_query, query, m);
+		opt_query[m] = '\0';
+		start = get_msec();
+		score_all();
+		msec += get_msec() - start;
+	}
+	uint32_t nb_calls = query_size + 1;
+	print_stage("score_all/typing", nb_calls, msec,
+			size * nb_calls, (uint64_t)nb_records * nb_calls);
+
+	msec = 0;
+	for (uint32_t round = 0; round < NB_ROUNDS; ++round) {
+		records_changed = true;
+		start = get_msec();
+		score_all();
+		msec += get_msec() - start;
+	}
+	print_stage("score_all/full", NB_ROUNDS, msec,
+			size * NB_ROUNDS, (uint64_t)nb_records * NB_ROUNDS);
+
+	/* Every round sorts the same unordered matches. */
+	struct record **unsorted = malloc((nb_matches + !nb_matches) * sizeof *unsorted);
+	if (!unsorted)
+		abort();
+	memcpy(unsorted, records, nb_matches * sizeof *unsorted);
+
+	uint32_t nb_sorts[] = { NB_ROWS, nb_matches };
+	char const *sort_names[] = { "sort_all/rows", "sort_all/full" };
+	for (uint32_t i = 0; i < 2; ++i) {
+		msec = 0;
+		for (uint32_t round = 0; round < NB_ROUNDS; ++round) {
+			memcpy(records, unsorted, nb_matches * sizeof *records);
+			nb_sorted = 0;
+			start = get_msec();
+			sort_all(nb_sorts[i]);
+			msec += get_msec() - start;
+		}
+		print_stage(sort_names[i], NB_ROUNDS, msec, 0,
+				(uint64_t)nb_matches * NB_ROUNDS);
+	}
+	free(unsorted);
+
+	uint64_t printed_size = 0;
+	uint32_t nb_printed = 0;
+	msec = 0;
+	for (uint32_t round = 0; round < NB_ROUNDS; ++round) {
+		/* Nothing is on the screen. */
+		nb_screen_rows = 0;
+		start = get_msec();
+		uint32_t n = print_records(NB_ROWS);
+		fflush(tty);
+		msec += get_msec() - start;
+
+		nb_printed += n;
+		for (uint32_t i = 0; i < n; ++i)
+			printed_size += get_size(records[i]);
+	}
+	print_stage("print_records", NB_ROUNDS, msec, printed_size, nb_printed);
+
+	fclose(tty);
+	return EXIT_SUCCESS;
+}
+
+static int
+compare_hits(void const *px, void const *py)
+{
+	struct hit const *x = px;
+	struct hit const *y = py;
+	int cmp = COMPARE(x->hi, y->hi);
+	return cmp ? cmp : COMPARE(x->lo, y->lo);
+}
+
+/* Keep best k hits in a max-heap, worst one first. */
+static void
+add_hit(struct hit *heap, uint32_t *n, uint32_t k, struct hit hit)
+{
+	uint32_t i;
+	if (*n < k) {
+		/* Sift up from new leaf. */
+		for (i = (*n)++; 0 < i && compare_hits(&heap[(i - 1) / 2], &hit) < 0; i = (i - 1) / 2)
+			heap[i] = heap[(i - 1) / 2];
+	} else if (compare_hits(&hit, &heap[0]) < 0) {
+		/* Sift down from replaced root. */
+		i = 0;
+		for (uint32_t child; (child = 2 * i + 1) < k; i = child) {
+			if (child + 1 < k && compare_hits(&heap[child], &heap[child + 1]) < 0)
+				++child;
+			if (compare_hits(&hit, &heap[child]) >= 0)
+				break;
+			heap[i] = heap[child];
+		}
+	} else {
+		return;
+	}
+	heap[i] = hit;
+}
+
+/* What run_batch() shares with pool threads. */
+struct batch_work {
+	struct query const *queries;
+	/* qmats of queries[first..last) after each other. */
+	uint64_t (*qmats)[UINT8_MAX + 1][MASK_WORDS];
+	uint32_t first;
+	uint32_t last;
+	uint32_t nb_segments;
+	uint32_t k;
+	/* [segment][query - first]=Best k hits and their count. */
+	struct hit *hits;
+	uint32_t *nb_hits;
+};
+
+static void
+score_segments(void *arg, uint32_t from, uint32_t to)
+{
+	struct batch_work *w = arg;
+	uint32_t nb_queries = w->last - w->first;
+
+	for (uint32_t segment = from; segment < to; ++segment) {
+		uint32_t i = (uint64_t)nb_records * segment / w->nb_segments;
+		uint32_t end = (uint64_t)nb_records * (segment + 1) / w->nb_segments;
+
+		while (i < end) {
+			/* Chunk stays in cache while every query is scored. */
+			uint32_t chunk_end = i;
+			for (size_t bytes = 0; chunk_end < end && bytes < BATCH_CHUNK_BYTES; ++chunk_end)
+				bytes += POOL_RECORD_BYTES + records[chunk_end]->size;
+
+			uint64_t (*qmats)[UINT8_MAX + 1][MASK_WORDS] = w->qmats;
+			for (uint32_t q = 0; q < nb_queries; ++q) {
+				struct query const *query = &w->queries[w->first + q];
+				uint32_t slot = segment * nb_queries + q;
+				struct hit *heap = &w->hits[(size_t)slot * w->k];
+
+				for (uint32_t j = i; j < chunk_end; ++j) {
+					struct record *record = records[j];
+					score_record(record, query, qmats, NULL, 0);
+					if (record->score)
+						add_hit(heap, &w->nb_hits[slot], w->k, (struct hit){
+							.hi = get_key_hi(record),
+							.lo = get_key_lo(record),
+						});
+				}
+				qmats += query->nb_terms;
+			}
+
+			i = chunk_end;
+		}
+	}
+}
+
+/* Print best k matches of the group. */
+static void
+print_hits(struct batch_work const *w)
+{
+	uint32_t nb_queries = w->last - w->first;
+	struct hit *hits = malloc((size_t)w->nb_segments * w->k * sizeof *hits);
+	if (!hits)
+		abort();
+
+	for (uint32_t q = 0; q < nb_queries; ++q) {
+		uint32_t n = 0;
+		for (uint32_t segment = 0; segment < w->nb_segments; ++segment) {
+			uint32_t slot = segment * nb_queries + q;
+			memcpy(hits + n, &w->hits[(size_t)slot * w->k],
+					w->nb_hits[slot] * sizeof *hits);
+			n += w->nb_hits[slot];
+		}
+		qsort(hits, n, sizeof *hits, compare_hits);
+		if (w->k < n)
+			n = w->k;
+
+		for (uint32_t i = 0; i < n; ++i) {
+			struct record const *record = records[(uint32_t)hits[i].lo];
+			uint32_t score = ~(hits[i].hi >> 32);
+			/* Query has no fuzzy terms. */
+			if (UINT32_MAX == score)
+				score = 0;
+			printf("%"PRIu32"\t%"PRIu64"\t%"PRIu32,
+					w->first + q, record->index, score);
+			if (!opt_print_indices) {
+				putchar('\t');
+				print_record(record, stdout);
+			}
+			putchar(opt_delim);
+		}
+	}
+
+	free(hits);
+}
+
+/* Evaluate queries of a file, scoring records for groups of them at once. */
+static int
+run_batch(void)
+{
+	FILE *stream = fopen(opt_batch, "r");
+	if (!stream) {
+		perror("Cannot open queries");
+		return EXIT_FAILURE;
+	}
+
+	char **lines = NULL;
+	uint32_t nb_lines = 0;
+	char *line = NULL;
+	size_t line_size = 0;
+	for (ssize_t len; 0 <= (len = getline(&line, &line_size, stream));) {
+		if (len && '\n' == line[len - 1])
+			line[len - 1] = '\0';
+		if (!(nb_lines & (nb_lines - 1))) {
+			lines = realloc(lines, (2 * nb_lines + !nb_lines) * sizeof *lines);
+			if (!lines)
+				abort();
+		}
+		lines[nb_lines++] = line;
+		line = NULL;
+		line_size = 0;
+	}
+	free(line);
+	fclose(stream);
+
+	/* Terms point into queries so they cannot be moved after parsing. */
+	struct query *queries = malloc((nb_lines + !nb_lines) * sizeof *queries);
+	if (!queries)
+		abort();
+	for (uint32_t q = 0; q < nb_lines; ++q) {
+		char buf[sizeof opt_query];
+		snprintf(buf, sizeof buf, "%s", lines[q]);
+		parse_query(&queries[q], buf);
+		free(lines[q]);
+	}
+	free(lines);
+
+	if (!workers)
+		start_pool();
+
+	struct batch_work w = {
+		.queries = queries,
+		.nb_segments = 4 * nb_threads,
+		.k = 0 < opt_lines ? (uint32_t)opt_lines : BATCH_TOP,
+	};
+	if (nb_records < w.nb_segments)
+		w.nb_segments = nb_records + !nb_records;
+
+	while (w.first < nb_lines) {
+		uint32_t nb_terms = queries[w.first].nb_terms;
+		for (w.last = w.first + 1; w.last < nb_lines; ++w.last) {
+			uint32_t nb_queries = w.last + 1 - w.first;
+			if (BATCH_MAX_TERMS < nb_terms + queries[w.last].nb_terms ||
+			    BATCH_MAX_HITS / w.nb_segments / w.k < nb_queries)
+				break;
+			nb_terms += queries[w.last].nb_terms;
+		}
+
+		uint32_t nb_queries = w.last - w.first;
+		size_t nb_slots = (size_t)w.nb_segments * nb_queries;
+		w.qmats = malloc((nb_terms + !nb_terms) * sizeof *w.qmats);
+		w.hits = malloc(nb_slots * w.k * sizeof *w.hits);
+		w.nb_hits = calloc(nb_slots, sizeof *w.nb_hits);
+		if (!w.qmats || !w.hits || !w.nb_hits)
+			abort();
+
+		uint64_t (*qmats)[UINT8_MAX + 1][MASK_WORDS] = w.qmats;
+		for (uint32_t q = w.first; q < w.last; ++q) {
+			build_qmats(&queries[q], qmats);
+			qmats += queries[q].nb_terms;
+		}
+
+		parallel_for(w.nb_segments, NULL, score_segments, &w);
+		print_hits(&w);
+
+		free(w.nb_hits);
+		free(w.hits);
+		free(w.qmats);
+		w.first = w.last;
+	}
+
+	free(queries);
+	fflush(stdout);
+	return EXIT_SUCCESS;
+}
+
+/* Filter records while reading them instead of after. */
+static int
+run_stream(FILE *input)
+{
+	parse_query(&query, opt_query);
+	qmats = malloc((query.nb_terms + !query.nb_terms) * sizeof *qmats);
+	if (!qmats)
+		abort();
+	build_qmats(&query, qmats);
+
+	read_records(input, false);
+	fclose(input);
+
+	for (uint32_t i = 0; i < nb_matches; ++i)
+		emit_record(records[i], opt_print_indices, stdout);
+	nb_emitted += nb_matches;
+	fflush(stdout);
+
+	return nb_emitted ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Send to a non-blocking client. Give up at deadline, so a client not reading
+ * stalls the others only that long. */
+static bool
+send_all(int fd, char const *buf, size_t size, double deadline)
+{
+	while (size) {
+		ssize_t rc = send(fd, buf, size, MSG_NOSIGNAL);
+		if (rc < 0 && EINTR == errno)
+			continue;
+		if (rc < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+			int msec = deadline - get_msec();
+			struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+			if (msec <= 0 || (poll(&pfd, 1, msec) < 0 && EINTR != errno))
+				return false;
+			continue;
+		}
+		if (rc <= 0)
+			return false;
+		buf += rc;
+		size -= rc;
+	}
+	return true;
+}
+
+/* Answer "LIMIT FORMAT QUERY" with "MATCHES SIZE" line followed by SIZE bytes
+ * of the best LIMIT (or all if zero) matches, as indices if FORMAT is "i" or
+ * as records if it is "r". */
+static bool
+answer_request(int fd, char const *line)
+{
+	char *end;
+	unsigned long limit = strtoul(line, &end, 10);
+	if (end == line || ' ' != end[0] ||
+	    ('i' != end[1] && 'r' != end[1]) || ' ' != end[2])
+		return false;
+	bool indices = 'i' == end[1];
+	snprintf(opt_query, sizeof opt_query, "%s", end + 3);
+
+	/* Consecutive queries of a client usually narrow. */
+	score_all();
+	uint32_t n = limit && limit < nb_matches ? limit : nb_matches;
+	sort_all(n);
+
+	char *payload;
+	size_t payload_size;
+	FILE *stream = open_memstream(&payload, &payload_size);
+	if (!stream)
+		abort();
+	for (uint32_t i = 0; i < n; ++i)
+		emit_record(records[i], indices, stream);
+	if (fclose(stream))
+		abort();
+
+	char header[64];
+	int header_size = sprintf(header, "%"PRIu32" %zu\n", nb_matches, payload_size);
+	double deadline = get_msec() + CLIENT_TIMEOUT_MSEC;
+	bool ok = send_all(fd, header, header_size, deadline) &&
+	          send_all(fd, payload, payload_size, deadline);
+	free(payload);
+	return ok;
+}
+
+/* Answer complete requests of client. Return false if it should be
+ * disconnected. */
+static bool
+serve_client(struct client *client)
+{
+	ssize_t rc = read(client->fd, client->buf + client->size,
+			sizeof client->buf - client->size);
+	if (rc < 0 && (EINTR == errno || EAGAIN == errno || EWOULDBLOCK == errno))
+		return true;
+	if (rc <= 0)
+		return false;
+	client->size += rc;
+
+	char *line = client->buf;
+	for (char *lf; (lf = memchr(line, '\n', client->buf + client->size - line));) {
+		*lf = '\0';
+		if (!answer_request(client->fd, line))
+			return false;
+		line = lf + 1;
+	}
+	client->size -= line - client->buf;
+	memmove(client->buf, line, client->size);
+
+	/* Request is too long. */
+	return client->size < sizeof client->buf;
+}
+
+static void
+remove_socket(void)
+{
+	unlink(opt_serve);
+}
+
+static bool
+make_address(struct sockaddr_un *addr, char const *path)
+{
+	memset(addr, 0, sizeof *addr);
+	addr->sun_family = AF_UNIX;
+	if (sizeof addr->sun_path <= strlen(path)) {
+		fputs("Socket path is too long\n", stderr);
+		return false;
+	}
+	strcpy(addr->sun_path, path);
+	return true;
+}
+
+/* Keep records and answer queries of clients one after the other. Clients
+ * share the results of the previous query, whoever asked it. */
+static int
+serve(void)
+{
+	struct sockaddr_un addr;
+	if (!make_address(&addr, opt_serve))
+		return EXIT_FAILURE;
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(opt_serve);
+	if (sock < 0 ||
+	    bind(sock, (struct sockaddr *)&addr, sizeof addr) < 0 ||
+	    listen(sock, SOMAXCONN) < 0)
+	{
+		perror("Cannot listen on socket");
+		return EXIT_FAILURE;
+	}
+	atexit(remove_socket);
+
+	signal(SIGINT, handle_interrupt);
+	signal(SIGTERM, handle_interrupt);
+
+	struct client *clients = NULL;
+	struct pollfd *fds = NULL;
+	uint32_t nb_clients = 0;
+	for (;;) {
+		fds = realloc(fds, (1 + nb_clients) * sizeof *fds);
+		if (!fds)
+			abort();
+		fds[0] = (struct pollfd){ .fd = sock, .events = POLLIN };
+		for (uint32_t i = 0; i < nb_clients; ++i)
+			fds[1 + i] = (struct pollfd){ .fd = clients[i].fd, .events = POLLIN };
+
+		if (poll(fds, 1 + nb_clients, -1) < 0) {
+			if (EINTR == errno)
+				continue;
+			perror("Cannot poll");
+			return EXIT_FAILURE;
+		}
+
+		for (uint32_t i = nb_clients; 0 < i--;)
+			if (fds[1 + i].revents && !serve_client(&clients[i])) {
+				close(clients[i].fd);
+				clients[i] = clients[--nb_clients];
+			}
+
+		if (fds[0].revents) {
+			int fd = accept(sock, NULL, NULL);
+			if (fd < 0)
+				continue;
+			if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+				close(fd);
+				continue;
+			}
+			clients = realloc(clients, (nb_clients + 1) * sizeof *clients);
+			if (!clients)
+				abort();
+			clients[nb_clients].fd = fd;
+			clients[nb_clients].size = 0;
+			++nb_clients;
+		}
+	}
+}
+
+/* Ask server for matches of query and print them like filter mode. */
+static int
+query_server(void)
+{
+	struct sockaddr_un addr;
+	if (!make_address(&addr, opt_connect))
+		return EXIT_FAILURE;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+		perror("Cannot connect to server");
+		return EXIT_FAILURE;
+	}
+
+	FILE *stream = fdopen(fd, "r+");
+	if (!stream)
+		abort();
+	fprintf(stream, "%d %c %s\n", opt_lines,
+			opt_print_indices ? 'i' : 'r', opt_query);
+	fflush(stream);
+
+	char header[64];
+	uint32_t nb_found;
+	size_t size;
+	if (!fgets(header, sizeof header, stream) ||
+	    2 != sscanf(header, "%"SCNu32" %zu", &nb_found, &size))
+	{
+		fputs("Invalid response from server\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	while (size) {
+		char buf[BUFSIZ];
+		size_t n = fread(buf, 1, size < sizeof buf ? size : sizeof buf, stream);
+		if (!n) {
+			fputs("Invalid response from server\n", stderr);
+			return EXIT_FAILURE;
+		}
+		fwrite(buf, 1, n, stdout);
+		size -= n;
+	}
+	fclose(stream);
+	fflush(stdout);
+
+	return nb_found ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 int
 main(int argc, char *argv[])
 {
-	for (int opt; -1 != (opt = getopt(argc, argv, "01acfh:il:np:q:sux:" IF1(WITH_OMP, "j:")));)
+	for (int opt; -1 != (opt = getopt(argc, argv, "01aB:bC:cFfh:iI:j:l:m:np:q:S:stT:ux:"));)
 		switch (opt) {
 		case '0':
 			opt_delim = '\0';
@@ -869,10 +3960,26 @@ main(int argc, char *argv[])
 			opt_prefix_alpha = true;
 			break;
 
+		case 'B':
+			opt_batch = optarg;
+			break;
+
+		case 'b':
+			opt_benchmark = true;
+			break;
+
+		case 'C':
+			opt_connect = optarg;
+			break;
+
 		case 'c':
 			opt_print_changes = true;
 			break;
 
+		case 'F':
+			opt_stream = true;
+			break;
+
 		case 'f':
 			opt_interactive = false;
 			break;
@@ -885,16 +3992,34 @@ main(int argc, char *argv[])
 			opt_print_indices = true;
 			break;
 
-#if WITH_OMP
 		case 'j':
-			omp_set_num_threads(atoi(optarg));
+			opt_nb_threads = atoi(optarg);
+			break;
+
+		case 'I':
+			opt_index = optarg;
 			break;
-#endif
 
 		case 'l':
 			opt_lines = atoi(optarg);
 			break;
 
+		case 'm':
+		{
+			char *end;
+			errno = 0;
+			unsigned long mib = strtoul(optarg, &end, 10);
+			/* strtoul() would skip spaces and negate. */
+			if (!('0' <= *optarg && *optarg <= '9') || *end ||
+			    errno || SIZE_MAX >> 20 < mib)
+			{
+				fputs("Invalid memory limit\n", stderr);
+				return EXIT_FAILURE;
+			}
+			opt_cache_size = (size_t)mib << 20;
+			break;
+		}
+
 		case 'p':
 			opt_prompt = optarg;
 			break;
@@ -903,10 +4028,22 @@ main(int argc, char *argv[])
 			snprintf(opt_query, sizeof opt_query, "%s", optarg);
 			break;
 
+		case 'S':
+			opt_serve = optarg;
+			break;
+
 		case 's':
 			opt_sort = false;
 			break;
 
+		case 't':
+			opt_show_stats = true;
+			break;
+
+		case 'T':
+			opt_stats_fd = atoi(optarg);
+			break;
+
 		case 'u':
 			opt_hi_start = "\033[4m";
 			opt_hi_end = "\033[24m";
@@ -924,6 +4061,16 @@ main(int argc, char *argv[])
 		}
 
 	setvbuf(stdout, NULL, _IOFBF, BUFSIZ);
+	setup_simd();
+	setup_wide();
+
+	if (0 <= opt_stats_fd)
+		atexit(write_stats);
+	if (opt_index)
+		atexit(remove_index_tmp);
+
+	if (opt_connect)
+		return query_server();
 
 	FILE *input;
 	if (isatty(STDIN_FILENO))
@@ -936,29 +4083,32 @@ main(int argc, char *argv[])
 	}
 
 	clear_records();
-	read_records(input);
+	if (opt_benchmark)
+		return benchmark(input);
+	if (opt_stream)
+		return run_stream(input);
+	/* Scripted keys expect all records. */
+	if (opt_interactive && !opt_serve && !opt_batch &&
+	    !opt_auto_accept_only && !*opt_execute)
+	{
+		start_reading(input);
+	} else {
+		read_records(input, false);
+		fclose(input);
+	}
 	nb_matches = nb_total_records;
 	nb_records = nb_total_records;
 
-	fclose(input);
+	if (opt_serve)
+		return serve();
+	if (opt_batch)
+		return run_batch();
 
 	if (opt_auto_accept_only)
 		accept_only();
 
-#if 0
-	for (int i = 0; i < 3; ++i)
-		for (int i = 20; --i > 0;) {
-			strcpy(opt_query, "heeeeeeeeeeeeeeeeeeeeeeeee");
-			opt_query[i] = '\0';
-			/* sprintf(opt_query, "-/%d%d%d", i, i, i); */
-			score_all();
-		}
-	return 0;
-#endif
-
 	if (!opt_interactive) {
 		score_all();
-		sort_all();
 		accept_all();
 	}
 
@@ -967,7 +4117,8 @@ main(int argc, char *argv[])
 		perror("Cannot open terminal");
 		exit(EXIT_FAILURE);
 	}
-	setvbuf(tty, NULL, _IOFBF, BUFSIZ);
+	/* Fit whole frame so it is written at once. */
+	setvbuf(tty, NULL, _IOFBF, CHUNK_SIZE);
 
 	rl_readline_name = argv[0];
 	rl_instream = tty;
@@ -982,6 +4133,7 @@ main(int argc, char *argv[])
 	rl_add_defun("fizzy-emit-one", fizzy_rl_emit_one, -1);
 	rl_add_defun("fizzy-exit", fizzy_rl_exit, -1);
 	rl_add_defun("fizzy-filter-matched", fizzy_rl_filter_matched, -1);
+	rl_add_defun("fizzy-filter-pop", fizzy_rl_filter_pop, -1);
 	rl_add_defun("fizzy-filter-reset", fizzy_rl_filter_reset, -1);
 
 	setup_term();
@@ -996,33 +4148,57 @@ main(int argc, char *argv[])
 	rl_resize_terminal();
 
 	for (;;) {
-		fputs(!opt_lines ? "\033[H\033[2J" : "\r\033[J", tty);
-		fputs("\n\033[m", tty);
-
 		int rows, cols;
 		rl_get_screen_size(&rows, &cols);
 		if (opt_lines && opt_lines + 2 < rows)
 			rows = opt_lines + 2;
 
-		score_all();
-		sort_all();
-		if (opt_print_changes)
+		if (rows != screen_height || cols != screen_width) {
+			screen_height = rows;
+			screen_width = cols;
+			nb_screen_rows = 0;
+		}
+		if (!nb_screen_rows)
+			fputs(!opt_lines ? "\033[H\033[2J" : "\r\033[J", tty);
+		else
+			fputs(!opt_lines ? "\033[H" : "\r", tty);
+
+		start_scoring();
+		/* Show best of what is scored so far and continue after
+		 * handling keys. */
+		bool scored = score_some(!*opt_execute);
+		/* Visible ones. */
+		sort_all(2 < rows ? rows - 2 : 1);
+		if (opt_print_changes && scored)
 			emit_one();
 
-		if (nb_records == nb_total_records)
-			fprintf(tty, "[%"PRIu32"/%"PRIu32"] ",
-					nb_matches, nb_records);
+		line_size = 0;
+		char const *more = scored ? "" : "+";
+		if (!levels)
+			printf_line("[%"PRIu32"%s/%"PRIu32"] ",
+					nb_matches, more, nb_records);
 		else
-			fprintf(tty, "[%"PRIu32"/%"PRIu32" (%"PRIu32")] ",
-					nb_matches, nb_records, nb_total_records);
-		fputs(opt_header, tty);
-
-		uint32_t n = print_records(rows - 2);
+			printf_line("[%"PRIu32"%s/%"PRIu32" (%"PRIu32")] ",
+					nb_matches, more, nb_records, nb_total_records);
+		if (opt_show_stats)
+			print_stats();
+		write_line(opt_header, strlen(opt_header));
+		draw_line(0, NULL);
+
+		uint32_t n = 1 + print_records(rows - 2);
+
+		/* Clear rows of previous frame. */
+		uint32_t up = n;
+		if (n < nb_screen_rows) {
+			fputs("\n\033[m\033[J", tty);
+			++up;
+		}
+		nb_screen_rows = n;
 
 		if (!opt_lines)
 			fputs("\033[H", tty);
 		else
-			fprintf(tty, "\033[%"PRIu32"A\r", n + 1);
+			fprintf(tty, "\033[%"PRIu32"A\r", up);
 		fputs("\033[m", tty);
 
 		/* Otherwise no prompt in $(...). Should be reset also
@@ -1036,9 +4212,20 @@ main(int argc, char *argv[])
 			if (*opt_execute) {
 				rl_stuff_char(*opt_execute);
 				++opt_execute;
+			} else if (!wait_key()) {
+				break;
 			}
+			double start_msec = get_msec();
 			rl_callback_read_char();
-		} while (!records_changed && !strcmp(opt_query, rl_line_buffer));
-		snprintf(opt_query, sizeof opt_query, "%s", rl_line_buffer);
+			frame.readline_msec += get_msec() - start_msec;
+
+			/* Prompt is all what is left. */
+			if (rl_clear_screen == rl_last_func)
+				nb_screen_rows = 0;
+		} while (nb_screen_rows &&
+		         !records_changed &&
+		         !strcmp(opt_query, rl_line_buffer));
+		update_query(rl_line_buffer);
+		end_frame();
 	}
 }